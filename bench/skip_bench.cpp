@@ -0,0 +1,368 @@
+// Compares fdistream against std::ifstream and plain read(2) when
+// alternately reading and skipping through regular files, fifos,
+// sockets and /dev/zero, sweeping buffer sizes, skip sizes and
+// read/skip ratios.
+//
+// Build and run (from the repo root):
+//
+//     g++ -std=c++17 -O2 -I. bench/skip_bench.cpp fdstream.cpp -o skip_bench -pthread
+//     ./skip_bench [mib_per_run] [reg|fifo|sock|zero ...] > bench_output.txt
+//
+// Each run traverses `mib_per_run` (default 64) MiB of input. Output is
+// tab-separated: input, reader, buffer size, read size, skip size,
+// GB/s traversed and I/O syscalls per GB. fdistream's syscalls come
+// from its own counters (`fdistream::stats`) and include every read,
+// seek and splice. The others' are the reader thread's `syscr`+`syscw`
+// from /proc/thread-self/io, which the kernel only updates for
+// read/write-style calls, so `std::ifstream`'s seeks aren't counted.
+// The regular file is read from a warm page cache.
+
+#include "fdstream.hpp"
+
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+  constexpr size_t mib = 1<<20;
+
+  struct Result {
+    double seconds;
+    unsigned long long syscalls;
+  };
+
+  unsigned long long io_syscalls() {
+    std::ifstream io{"/proc/thread-self/io"};
+    std::string key;
+    unsigned long long val, total = 0;
+    while (io >> key >> val) {
+      if (key == "syscr:" || key == "syscw:") {
+        total += val;
+      }
+    }
+    return total;
+  }
+
+  // an input that can be opened once per run, by path or by fd
+  class Input {
+  public:
+    virtual ~Input() = default;
+    virtual std::string name() const = 0;
+    // starts a run: returns the path for readers that need one, and
+    // sets `fd` for readers that take an fd (-1 if they must open the
+    // path themselves)
+    virtual std::string start(int& fd) = 0;
+    // ends a run: closes whatever `start` opened and reaps writers
+    virtual void finish() = 0;
+    virtual bool seekable() const { return false; }
+    virtual bool has_path() const { return true; }
+  };
+
+  // writes `total` bytes into `fd` on a background thread, then closes it
+  std::thread writer(int fd, size_t total) {
+    return std::thread{[fd, total] {
+      std::vector<char> buf(mib, 'x');
+      size_t done = 0;
+      while (done < total) {
+        ssize_t n = ::write(fd, buf.data(), std::min(buf.size(), total - done));
+        if (n <= 0) {
+          break;
+        }
+        done += n;
+      }
+      ::close(fd);
+    }};
+  }
+
+  class RegInput : public Input {
+  public:
+    RegInput(const std::string& dir, size_t total): pth{dir + "/reg"} {
+      std::ofstream out{pth, std::ios::binary};
+      std::vector<char> buf(mib, 'x');
+      for (size_t done = 0; done < total; done += buf.size()) {
+        out.write(buf.data(), buf.size());
+      }
+    }
+    ~RegInput() { ::unlink(pth.c_str()); }
+    std::string name() const override { return "reg"; }
+    std::string start(int& fd) override { fd = -1; return pth; }
+    void finish() override {}
+    bool seekable() const override { return true; }
+  private:
+    std::string pth;
+  };
+
+  class FifoInput : public Input {
+  public:
+    FifoInput(const std::string& dir, size_t total): pth{dir + "/fifo"}, total{total} {
+      if (::mkfifo(pth.c_str(), 0600) == -1) {
+        throw std::runtime_error{"mkfifo: " + std::string{strerror(errno)}};
+      }
+    }
+    ~FifoInput() { ::unlink(pth.c_str()); }
+    std::string name() const override { return "fifo"; }
+    std::string start(int& fd) override {
+      // opening either end blocks until the other is opened, so the
+      // writer opens its end on its own thread
+      this->w = std::thread{[this] {
+        int out = ::open(this->pth.c_str(), O_WRONLY);
+        writer(out, this->total).join();
+      }};
+      fd = -1;
+      return pth;
+    }
+    void finish() override { this->w.join(); }
+  private:
+    std::string pth;
+    size_t total;
+    std::thread w;
+  };
+
+  class SockInput : public Input {
+  public:
+    SockInput(size_t total): total{total} {}
+    std::string name() const override { return "sock"; }
+    std::string start(int& fd) override {
+      int sv[2];
+      if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+        throw std::runtime_error{"socketpair: " + std::string{strerror(errno)}};
+      }
+      this->w = writer(sv[1], this->total);
+      this->fd = fd = sv[0];
+      return {};
+    }
+    void finish() override {
+      ::close(this->fd);
+      this->w.join();
+    }
+    bool has_path() const override { return false; }
+  private:
+    size_t total;
+    int fd = -1;
+    std::thread w;
+  };
+
+  class ZeroInput : public Input {
+  public:
+    std::string name() const override { return "zero"; }
+    std::string start(int& fd) override { fd = -1; return "/dev/zero"; }
+    void finish() override {}
+  };
+
+  struct Params {
+    size_t total;
+    size_t bufsize;
+    size_t readsize;
+    size_t skipsize;
+  };
+
+  // reads `readsize`, skips `skipsize`, until `total` bytes are behind it
+  template<typename Read, typename Skip>
+  Result traverse(const Params& p, Read&& read, Skip&& skip) {
+    std::vector<char> dst(p.readsize);
+    auto syscalls = io_syscalls();
+    auto t0 = std::chrono::steady_clock::now();
+
+    size_t pos = 0;
+    while (pos < p.total) {
+      size_t r = std::min(p.readsize, p.total - pos);
+      if (r > 0 && !read(dst.data(), r)) {
+        break;
+      }
+      pos += r;
+
+      size_t s = std::min(p.skipsize, p.total - pos);
+      if (s > 0 && !skip(s)) {
+        break;
+      }
+      pos += s;
+    }
+
+    auto t1 = std::chrono::steady_clock::now();
+    if (pos < p.total) {
+      throw std::runtime_error{"input ended early"};
+    }
+    return {std::chrono::duration<double>(t1 - t0).count(), io_syscalls() - syscalls};
+  }
+
+  Result run_fdistream(Input& src, const Params& p) {
+    int fd;
+    std::string pth = src.start(fd);
+    std::vector<char> buf(p.bufsize);
+    Result r;
+    {
+      std::unique_ptr<ak::fdistream> in{fd == -1 ? new ak::fdistream(pth) : new ak::fdistream(fd)};
+      in->rdbuf()->pubsetbuf(buf.data(), buf.size());
+      r = traverse(p,
+                   [&](char* dst, size_t n) { return static_cast<bool>(in->read(dst, n)); },
+                   [&](size_t n) { return static_cast<bool>(in->seekg(n, std::ios::cur)); });
+      ak::fdstats s = in->stats();
+      r.syscalls = s.reads + s.seeks + s.splices;
+    }
+    src.finish();
+    return r;
+  }
+
+  Result run_ifstream(Input& src, const Params& p) {
+    int fd;
+    std::string pth = src.start(fd);
+    std::vector<char> buf(p.bufsize);
+    Result r;
+    {
+      std::ifstream in;
+      in.rdbuf()->pubsetbuf(buf.data(), buf.size());
+      in.open(pth, std::ios::binary);
+      bool seekable = src.seekable();
+      r = traverse(p,
+                   [&](char* dst, size_t n) { return static_cast<bool>(in.read(dst, n)); },
+                   [&](size_t n) {
+                     // what callers do: seek where they can, else discard
+                     if (seekable) {
+                       in.seekg(n, std::ios::cur);
+                     } else {
+                       in.ignore(n);
+                     }
+                     return static_cast<bool>(in);
+                   });
+    }
+    src.finish();
+    return r;
+  }
+
+  // unbuffered reads; skips read and discard `bufsize` at a time
+  Result run_read(Input& src, const Params& p) {
+    int fd;
+    std::string pth = src.start(fd);
+    bool owned = fd == -1;
+    if (owned) {
+      fd = ::open(pth.c_str(), O_RDONLY);
+    }
+
+    auto read_exactly = [fd](char* dst, size_t n) {
+      while (n > 0) {
+        ssize_t got = ::read(fd, dst, n);
+        if (got <= 0) {
+          return false;
+        }
+        dst += got;
+        n -= got;
+      }
+      return true;
+    };
+
+    std::vector<char> buf(p.bufsize);
+    Result r = traverse(p, read_exactly, [&](size_t n) {
+      while (n > 0) {
+        size_t len = std::min(n, buf.size());
+        if (!read_exactly(buf.data(), len)) {
+          return false;
+        }
+        n -= len;
+      }
+      return true;
+    });
+
+    if (owned) {
+      ::close(fd);
+    }
+    src.finish();
+    return r;
+  }
+
+  std::string human(size_t n) {
+    if (n >= mib && n % mib == 0) {
+      return std::to_string(n / mib) + "M";
+    } else if (n >= 1024 && n % 1024 == 0) {
+      return std::to_string(n / 1024) + "K";
+    }
+    return std::to_string(n);
+  }
+}
+
+int main(int argc, char** argv) {
+  size_t total = (argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 64) * mib;
+  std::vector<std::string> kinds(argv + std::min(argc, 2), argv + argc);
+  if (kinds.empty()) {
+    kinds = {"reg", "fifo", "sock", "zero"};
+  }
+
+  // writers outlive readers that stop at `total`
+  std::signal(SIGPIPE, SIG_IGN);
+
+  char dir[] = "/tmp/skip_bench.XXXXXX";
+  if (::mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+
+  std::vector<std::unique_ptr<Input>> inputs;
+  for (const auto& k : kinds) {
+    if (k == "reg") {
+      inputs.emplace_back(new RegInput(dir, total));
+    } else if (k == "fifo") {
+      inputs.emplace_back(new FifoInput(dir, total));
+    } else if (k == "sock") {
+      inputs.emplace_back(new SockInput(total));
+    } else if (k == "zero") {
+      inputs.emplace_back(new ZeroInput());
+    } else {
+      std::cerr << k << ": unknown input (want reg, fifo, sock or zero)\n";
+      return 1;
+    }
+  }
+
+  struct Reader {
+    const char* name;
+    Result (*run)(Input&, const Params&);
+    bool needs_path;
+  };
+  const Reader readers[] = {
+    {"fdistream", run_fdistream, false},
+    {"ifstream", run_ifstream, true},
+    {"read+discard", run_read, false},
+  };
+
+  const size_t bufsizes[] = {1<<12, 1<<16, 1<<20};
+  const size_t skipsizes[] = {1<<9, 1<<16, 1<<20, 1<<24};
+  // read:skip ratios, as the divisor of the skip size
+  const size_t ratios[] = {1, 16, 256};
+
+  std::cout << "input\treader\tbufsize\tread\tskip\tGB/s\tsyscalls/GB\n";
+  for (auto& in : inputs) {
+    for (size_t bufsize : bufsizes) {
+      for (size_t skipsize : skipsizes) {
+        for (size_t ratio : ratios) {
+          Params p{total, bufsize, std::max<size_t>(1, skipsize / ratio), skipsize};
+          for (const auto& rd : readers) {
+            if (rd.needs_path && !in->has_path()) {
+              continue;
+            }
+            Result r = rd.run(*in, p);
+            double gb = total / 1e9;
+            std::cout << in->name() << '\t' << rd.name << '\t'
+                      << human(bufsize) << '\t' << human(p.readsize) << '\t' << human(skipsize) << '\t'
+                      << gb / r.seconds << '\t' << static_cast<unsigned long long>(r.syscalls / gb) << '\n';
+          }
+        }
+      }
+    }
+  }
+
+  inputs.clear();
+  ::rmdir(dir);
+}
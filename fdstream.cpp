@@ -2,35 +2,169 @@
 
 #include <sstream>
 #include <stdexcept>
+#include <cstdlib>
 #include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <limits>
+#include <exception>
+#include <memory>
+#include <new>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
 
+#ifdef FDSTREAM_ZLIB
+#include <zlib.h>
+#endif
+#ifdef FDSTREAM_ZSTD
+#include <zstd.h>
+#endif
+#ifdef FDSTREAM_LZ4
+#include <lz4frame.h>
+#endif
+
 namespace {
 
   constexpr size_t default_bufsize = 1<<13;
+  constexpr size_t reg_bufsize = 1<<17;  // default kernel readahead
+  constexpr size_t max_bufsize = 1<<20;
+  constexpr unsigned grow_after = 4;
+  constexpr size_t pool_max_buffers = 32;
+  constexpr size_t pool_max_bytes = 1<<26;
+  constexpr size_t hugepage_size = 1<<21;
+  constexpr size_t skip_pipesize = 1<<20;
+  constexpr size_t max_skip_pipesize = 1<<24;
+  constexpr size_t out_bufsize = 1<<16;
+  constexpr off_t drop_chunk = 1<<23;
+  constexpr size_t direct_align = 4096;
+  constexpr size_t would_block = static_cast<size_t>(-1);
+  constexpr size_t decode_bufsize = 1<<20;
+  constexpr size_t split_chunk = 1<<16;
+  constexpr size_t default_mapsize = 1<<28;
+  constexpr size_t prefetch_depth = 3;
+  constexpr unsigned ring_entries = 8;
+  constexpr size_t max_index_entries = 1<<16;
+  constexpr size_t max_peek = size_t{1}<<47;  // a whole user address space
+  constexpr size_t skip_readahead_bufs = 4;
 
   enum class FdType {
     reg,
     fifo,
+    sock,
     other,
   };
 
+  // skips shorter than this (per `FdType`) are read with whatever
+  // follows them and dropped, rather than costing a syscall of their
+  // own: below these sizes, copying the bytes was measured to be
+  // cheaper than an `lseek(2)`, a `splice(2)` into /dev/null or the two
+  // `splice(2)`s through a pipe
+  constexpr size_t discard_below[] = {
+    1<<12,  // reg
+    1<<14,  // fifo
+    1<<14,  // sock
+    1<<14,  // other
+  };
+
+  // `st_mode` is an enum, not a bitmask: `S_IFSOCK` shares bits with
+  // `S_IFREG`, so the `S_IS*` macros must be used
+  FdType classify(const struct stat& s) {
+    if (S_ISREG(s.st_mode)) {
+      return FdType::reg;
+    } else if (S_ISFIFO(s.st_mode)) {
+      return FdType::fifo;
+    } else if (S_ISSOCK(s.st_mode)) {
+      return FdType::sock;
+    } else {
+      return FdType::other;
+    }
+  }
+
+  enum class Engine {
+    syscall,
+    uring,
+  };
+
+  class Mapping;
+  class Pipe;
+  class Ring;
+
+  // a counter with one writer at a time (a stream's thread, or its
+  // prefetcher), so it is bumped with a plain load and store rather
+  // than an atomic read-modify-write. The atomic only makes reading it
+  // from another thread well-defined
+  class Counter {
+  public:
+    void add(uint64_t n) {
+      this->v.store(this->v.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    uint64_t get() const {
+      return this->v.load(std::memory_order_relaxed);
+    }
+  private:
+    std::atomic<uint64_t> v{0};
+  };
+
+  // see `ak::fdstats`
+  struct Counters {
+    Counter bytes_read;
+    Counter underflows;
+    Counter reads;
+    Counter seeks;
+    Counter splices;
+    Counter skipped_seek;
+    Counter skipped_splice;
+    Counter skipped_deferred;
+    Counter short_reads;
+    Counter eintr_retries;
+    Counter blocked_ns;
+  };
+
+  // totals of the streams closed on each thread
+  thread_local ak::fdstats closed_stats;
+
+  // adds the time until it goes out of scope to a counter
+  class Timer {
+  public:
+    Timer(Counter& _c): c{_c}, start{std::chrono::steady_clock::now()} {
+    }
+
+    ~Timer() noexcept {
+      auto elapsed = std::chrono::steady_clock::now() - this->start;
+      this->c.add(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+    }
+  private:
+    Counter& c;
+    std::chrono::steady_clock::time_point start;
+  };
+
   class Fd {
   public:
     Fd(int _fd): fd{_fd}, owned{false} {
       struct stat s;
       if (::fstat(this->fd, &s) != -1) {
-        if (s.st_mode & S_IFREG) {
-          this->type = FdType::reg;
-        } else if (s.st_mode & S_IFIFO) {
-          this->type = FdType::fifo;
-        } else {
-          this->type = FdType::other;
-        }
+        this->type = classify(s);
+        this->blksize = s.st_blksize;
       } else {
         std::stringstream msg;
         msg << "fd " << fd << ": " << strerror(errno);
@@ -39,7 +173,7 @@ namespace {
     }
 
     Fd(const std::string& pth, int flags): owned{true} {
-      while ((this->fd = ::open(pth.c_str(), flags)) == -1) {
+      while ((this->fd = ::open(pth.c_str(), flags, 0666)) == -1) {
         if (errno != EINTR) {
           std::stringstream msg;
           msg << pth << ": " << strerror(errno);
@@ -49,13 +183,8 @@ namespace {
 
       struct stat s;
       if (::fstat(this->fd, &s) != -1) {
-        if (s.st_mode & S_IFREG) {
-          this->type = FdType::reg;
-        } else if (s.st_mode & S_IFIFO) {
-          this->type = FdType::fifo;
-        } else {
-          this->type = FdType::other;
-        }
+        this->type = classify(s);
+        this->blksize = s.st_blksize;
       } else {
         ::close(this->fd);
         std::stringstream msg;
@@ -79,16 +208,48 @@ namespace {
     Fd& operator=(const Fd& other) = delete;
     Fd& operator=(Fd&& tmp) = delete;
 
+    friend FdType fdtype(const Fd& fd);
+    friend size_t preferred_bufsize(const Fd& fd);
+    friend void set_engine(Fd& fd, Engine e);
+    friend Ring* ring_for(const Fd& fd);
     friend size_t read(Fd& fd, void* buf, size_t count);
-    friend void lseek(Fd& fd, off_t offset, int whence);
-    friend void skip(Fd& fd, size_t n);
-    friend void splice_pipe_to_null(Fd& fd, size_t n);
-    friend void splice_to_null(Fd& fd, size_t n);
+    friend size_t pread(Fd& fd, void* buf, size_t count, off_t offset);
+    friend size_t readv(Fd& fd, const struct iovec* iov, int iovcnt);
+    friend size_t preadv(Fd& fd, const struct iovec* iov, int iovcnt, off_t offset);
+    friend size_t writev(Fd& fd, const struct iovec* iov, int iovcnt);
+    friend size_t splice_through_pipe(Fd& in, Fd& out, size_t n);
+    friend size_t forward(Fd& in, Fd& out, size_t n, off_t* offset);
+    friend off_t lseek(Fd& fd, off_t offset, int whence);
+    friend off_t size(Fd& fd);
+    friend std::streamsize queued(Fd& fd);
+    friend void fadvise(Fd& fd, off_t offset, off_t len, int advice);
+    friend void set_readahead(Fd& fd, size_t len);
+    friend void will_need(Fd& fd, off_t offset);
+    friend int native(const Fd& fd);
+    friend Counters& counters(Fd& fd);
+    friend ak::fdstats snapshot(const Fd& fd);
+    friend void count_read(Fd& fd, size_t asked, size_t got);
+    friend bool set_direct(Fd& fd, bool on);
+    friend bool set_nonblocking(Fd& fd);
+    friend void clear_nonblocking(Fd& fd) noexcept;
+    friend size_t skip(Fd& fd, size_t n);
+    friend size_t splice_pipe_to_null(Fd& fd, size_t n);
+    friend size_t splice_to_null(Fd& fd, size_t n);
+    friend void grow_for_skip(Fd& fd, size_t n);
+    friend size_t map(Fd& fd, Mapping& m, size_t window);
+    friend bool wait_readable(Fd& fd, Pipe& wake);
+    friend class ak::fdpump;
 
   private:
     int fd;
     FdType type;
+    size_t blksize;
     bool owned;
+    Engine engine = Engine::syscall;
+    size_t readahead_len = 0;
+    bool nonblocking = false;
+    bool grown = false;
+    Counters stats;
   };
 
   class Pipe {
@@ -118,204 +279,3640 @@ namespace {
     Pipe& operator=(const Pipe& other) = delete;
     Pipe& operator=(Pipe&& tmp) = delete;
 
-    friend void splice_to_null(Fd& fd, size_t n);
+    friend size_t splice_to_null(Fd& fd, size_t n);
+    friend size_t splice_through_pipe(Fd& in, Fd& out, size_t n);
+    friend size_t resize(Pipe& p, size_t n);
+    friend bool wait_for(int fd, short events, Pipe& wake);
+    friend void wake(Pipe& p);
+    friend class ak::fdpump;
 
   private:
     int read;
     int write;
   };
 
-  size_t read(Fd& fd, void* buf, size_t count) {
-    ssize_t n;
-    while ((n = ::read(fd.fd, buf, count)) == -1) {
-      if (errno != EINTR) {
-        std::stringstream msg;
-        msg << "read error: " << strerror(errno);
-        throw std::runtime_error{msg.str()};
-      }
+  // read-only window onto part of a regular file
+  class Mapping {
+  public:
+    Mapping() = default;
+    Mapping(const Mapping& other) = delete;
+    Mapping(Mapping&& tmp) = delete;
+
+    ~Mapping() noexcept {
+      this->reset();
     }
-    return n;
-  }
 
-  void skip(Fd& fd, size_t n) {
-    switch (fd.type) {
-    case FdType::reg:
-      lseek(fd, n,  SEEK_CUR);
-      break;
-    case FdType::fifo:
-      splice_pipe_to_null(fd, n);
-      break;
-    default:
-      splice_to_null(fd, n);
-      break;
+    Mapping& operator=(const Mapping& other) = delete;
+    Mapping& operator=(Mapping&& tmp) = delete;
+
+    void reset() noexcept {
+      if (this->addr != MAP_FAILED) {
+        ::munmap(this->addr, this->len);
+        this->addr = MAP_FAILED;
+        this->len = 0;
+        this->skew = 0;
+      }
     }
-  }
 
-  void lseek(Fd& fd, off_t offset, int whence) {
-    off_t o = ::lseek(fd.fd, offset, whence);
+    char* data() const noexcept {
+      return this->addr != MAP_FAILED
+        ? static_cast<char*>(this->addr) + this->skew
+        : nullptr;
+    }
 
-    if (o != -1) {
-      return;
-    } else {
-      std::stringstream msg;
-      msg << "seek error: " << strerror(errno);
-      throw std::runtime_error{msg.str()};
+    size_t size() const noexcept {
+      return this->len - this->skew;
     }
-  }
 
-  // input assertion: fd is a pipe and, therefore, can be `splice(2)`d
-  // directly into `/dev/null` in the kernel
-  void splice_pipe_to_null(Fd& fd, size_t n) {
-    thread_local Fd dev_null{"/dev/null", O_WRONLY};
+    friend size_t map(Fd& fd, Mapping& m, size_t window);
 
-    while (n > 0) {
-      ssize_t read = ::splice(fd.fd, NULL, dev_null.fd, NULL, n, 0);
-      if (read != -1) {
-        n -= read;
-        continue;
-      } else {
+  private:
+    void* addr = MAP_FAILED;
+    size_t len = 0;
+    size_t skew = 0;
+  };
+
+  // Minimal io_uring(7) instance, driven with raw syscalls so that
+  // liburing isn't needed. Operations are queued with `sqe` and then
+  // submitted together (e.g. as a linked chain) with one
+  // `io_uring_enter(2)` by `submit`, which waits for them to complete.
+  class Ring {
+  public:
+    Ring(unsigned entries) {
+      struct io_uring_params p;
+      std::memset(&p, 0, sizeof(p));
+
+      this->fd = ::syscall(__NR_io_uring_setup, entries, &p);
+      if (this->fd == -1) {
         std::stringstream msg;
-        msg << "splice_pipe_to_null failed: " << strerror(errno);
+        msg << "io_uring_setup failed: " << strerror(errno);
         throw std::runtime_error{msg.str()};
       }
-    }
-  }
+      this->features = p.features;
 
-  // This approach works with all fd types because it creates a
-  // (in-kernel) pipe and shuffles data (zero copy) kernel-side. In
-  // effect, it's the same as a traditional `read(2)` + `write(2)`
-  // with the limitation (and benefit) that the data is never copied
-  // to userspace.
-  void splice_to_null(Fd& fd, size_t n) {
-    thread_local Fd dev_null{"/dev/null", O_WRONLY};
-    thread_local Pipe p;
+      this->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+      this->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+      if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        this->sq_len = this->cq_len = std::max(this->sq_len, this->cq_len);
+      }
+      this->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
 
-    while (n > 0) {
-      ssize_t read = ::splice(fd.fd, NULL, p.write, NULL, n, 0);
+      this->sq = this->map(this->sq_len, IORING_OFF_SQ_RING);
+      this->cq = (p.features & IORING_FEAT_SINGLE_MMAP)
+        ? this->sq
+        : this->map(this->cq_len, IORING_OFF_CQ_RING);
+      this->sqes = static_cast<struct io_uring_sqe*>(this->map(this->sqes_len, IORING_OFF_SQES));
 
-      if (read > 0) {
-        ssize_t written = ::splice(p.read, NULL, dev_null.fd, NULL, read, 0);
-        if (written != -1) {
-          n -= read;
-          break;
-        } else {
-          std::stringstream msg;
-          msg << "splice write failed: " << strerror(errno);
-          throw std::runtime_error{msg.str()};
-        }
-      } else if (read == 0) {
+      if (this->sq == MAP_FAILED || this->cq == MAP_FAILED || this->sqes == MAP_FAILED) {
         std::stringstream msg;
-        msg << "splice read prematurely returned 0 bytes read (expected "
-            << n << " bytes to be read)";
-        throw std::runtime_error{msg.str()};
-      } else {
-        std::stringstream msg;
-        msg << "splice1 failed: " << strerror(errno);
+        msg << "io_uring mmap failed: " << strerror(errno);
+        this->release();
         throw std::runtime_error{msg.str()};
       }
-    }
-  }
-}
 
-namespace ak {
-  class fdbuf : public std::streambuf {
-  public:
-    fdbuf(const std::string& pth): fd{pth} {
-      this->setg(buf, buf, buf);
+      char* sqp = static_cast<char*>(this->sq);
+      this->sq_tail = reinterpret_cast<unsigned*>(sqp + p.sq_off.tail);
+      this->sq_mask = *reinterpret_cast<unsigned*>(sqp + p.sq_off.ring_mask);
+      this->sq_array = reinterpret_cast<unsigned*>(sqp + p.sq_off.array);
+
+      char* cqp = static_cast<char*>(this->cq);
+      this->cq_head = reinterpret_cast<unsigned*>(cqp + p.cq_off.head);
+      this->cq_tail = reinterpret_cast<unsigned*>(cqp + p.cq_off.tail);
+      this->cq_mask = *reinterpret_cast<unsigned*>(cqp + p.cq_off.ring_mask);
+      this->cqes = reinterpret_cast<struct io_uring_cqe*>(cqp + p.cq_off.cqes);
+
+      this->probe();
     }
 
-    fdbuf(int _fd): fd{_fd} {
-      this->setg(buf, buf, buf);
+    Ring(const Ring& other) = delete;
+    Ring(Ring&& tmp) = delete;
+
+    ~Ring() noexcept {
+      this->release();
     }
 
-    fdbuf(const fdbuf& other) = delete;
-    fdbuf(fdbuf&& tmp) = delete;
+    Ring& operator=(const Ring& other) = delete;
+    Ring& operator=(Ring&& tmp) = delete;
 
-    ~fdbuf() noexcept {
-      if (this->owned) {
-        delete[] this->buf;
+    // returns this thread's ring, or nullptr if io_uring isn't usable
+    // here (old kernel, seccomp, etc.), in which case callers should
+    // fall back to plain syscalls
+    static Ring* local() {
+      thread_local bool tried = false;
+      thread_local std::unique_ptr<Ring> ring;
+
+      if (!tried) {
+        tried = true;
+        try {
+          ring.reset(new Ring{ring_entries});
+          // reads must be able to use (and advance) the file offset
+          if (!(ring->features & IORING_FEAT_RW_CUR_POS)) {
+            ring.reset();
+          }
+        } catch (const std::runtime_error&) {
+        }
       }
+
+      return ring.get();
     }
 
-    fdbuf& operator=(const fdbuf& other) = delete;
-    fdbuf& operator=(fdbuf&& tmp) = delete;
+    // whether the kernel has `opcode`: the ring may be older than some
+    // of the operations queued on it (e.g. splices need 5.7)
+    bool supports(unsigned char opcode) const {
+      return opcode < this->ops.size() && this->ops[opcode];
+    }
 
-    std::streamsize xsgetn(char* s, std::streamsize n) override {
-      std::streamsize rem = n;
+    // queues a zeroed SQE, which is submitted by the next `submit`
+    struct io_uring_sqe* sqe(unsigned char opcode, int fd) {
+      unsigned tail = *this->sq_tail + this->queued;
+      unsigned idx = tail & this->sq_mask;
 
-      while (rem > 0) {
-        if (this->gptr() == this->egptr()) {
-          if (this->underflow() == std::char_traits<char>::eof()) {
-            return n - rem;
-          }
+      struct io_uring_sqe* e = &this->sqes[idx];
+      std::memset(e, 0, sizeof(*e));
+      e->opcode = opcode;
+      e->fd = fd;
+      e->user_data = this->queued;
+
+      this->sq_array[idx] = idx;
+      ++this->queued;
+
+      return e;
+    }
+
+    // submits all queued SQEs and blocks until they complete. The i-th
+    // queued SQE's result (`cqe->res`) is written to `res[i]`
+    void submit(int* res) {
+      unsigned n = this->queued;
+      __atomic_store_n(this->sq_tail, *this->sq_tail + n, __ATOMIC_RELEASE);
+      this->queued = 0;
+
+      unsigned to_submit = n;
+      unsigned reaped = 0;
+      while (reaped < n) {
+        int ret = ::syscall(__NR_io_uring_enter, this->fd, to_submit, n - reaped,
+                            IORING_ENTER_GETEVENTS, nullptr, 0);
+        if (ret == -1 && errno != EINTR) {
+          std::stringstream msg;
+          msg << "io_uring_enter failed: " << strerror(errno);
+          throw std::runtime_error{msg.str()};
+        } else if (ret != -1) {
+          // the kernel may have taken only some of them
+          to_submit -= std::min<unsigned>(ret, to_submit);
         }
 
-        auto avail = this->egptr() - this->gptr();
-        auto amt = std::min(rem, avail);
+        unsigned head = *this->cq_head;
+        while (head != __atomic_load_n(this->cq_tail, __ATOMIC_ACQUIRE)) {
+          const struct io_uring_cqe& c = this->cqes[head & this->cq_mask];
+          res[c.user_data] = c.res;
+          ++head;
+          ++reaped;
+        }
+        __atomic_store_n(this->cq_head, head, __ATOMIC_RELEASE);
+      }
+    }
 
-        std::copy(this->gptr(), this->gptr() + amt, s);
-        this->setg(this->eback(), this->gptr() + amt, this->egptr());
-        s += amt;
-        rem -= amt;
+    // `read(2)` at the fd's current offset, or `pread(2)` at `off`
+    ssize_t read(int fd, void* buf, size_t count, off_t off = -1) {
+      this->queue_read(fd, buf, count, off);
+
+      int res;
+      this->submit(&res);
+      return res;
+    }
+
+    // queues a `read`, e.g. one of several to `submit` together
+    void queue_read(int fd, void* buf, size_t count, off_t off = -1) {
+      struct io_uring_sqe* e = this->sqe(IORING_OP_READ, fd);
+      e->addr = reinterpret_cast<uintptr_t>(buf);
+      e->len = count;
+      e->off = static_cast<uint64_t>(off);
+    }
+
+    // `readv(2)` at the fd's current offset, or `preadv(2)` at `off`
+    ssize_t readv(int fd, const struct iovec* iov, int iovcnt, off_t off = -1) {
+      struct io_uring_sqe* e = this->sqe(IORING_OP_READV, fd);
+      e->addr = reinterpret_cast<uintptr_t>(iov);
+      e->len = iovcnt;
+      e->off = static_cast<uint64_t>(off);
+
+      int res;
+      this->submit(&res);
+      return res;
+    }
+
+    // queues `splice(2)` of `len` bytes from `in` to `out`
+    struct io_uring_sqe* splice(int in, int out, size_t len) {
+      struct io_uring_sqe* e = this->sqe(IORING_OP_SPLICE, out);
+      e->splice_fd_in = in;
+      e->splice_off_in = static_cast<uint64_t>(-1);
+      e->off = static_cast<uint64_t>(-1);
+      e->len = len;
+      return e;
+    }
+
+  private:
+    // fills `ops` from `IORING_REGISTER_PROBE`. If that fails, no
+    // opcode is assumed to be supported
+    void probe() {
+      std::vector<char> mem(sizeof(struct io_uring_probe) +
+                            IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+      auto* pr = reinterpret_cast<struct io_uring_probe*>(mem.data());
+      if (::syscall(__NR_io_uring_register, this->fd, IORING_REGISTER_PROBE, pr, IORING_OP_LAST) == -1) {
+        return;
+      }
+      this->ops.assign(pr->last_op + 1, false);
+      for (unsigned i = 0; i < pr->ops_len; ++i) {
+        if (pr->ops[i].flags & IO_URING_OP_SUPPORTED) {
+          this->ops[pr->ops[i].op] = true;
+        }
       }
+    }
 
-      return n - rem;
+    void release() noexcept {
+      if (this->sqes != MAP_FAILED) {
+        ::munmap(this->sqes, this->sqes_len);
+      }
+      if (this->cq != MAP_FAILED && this->cq != this->sq) {
+        ::munmap(this->cq, this->cq_len);
+      }
+      if (this->sq != MAP_FAILED) {
+        ::munmap(this->sq, this->sq_len);
+      }
+      ::close(this->fd);
     }
-    std::streampos seekoff(std::streamoff off,
-                           std::ios::seekdir way,
-                           std::ios::openmode which = std::ios::in | std::ios::out) override {
-      // This optimization is specifically for seeking forward
-      if (which == std::ios::out || way != std::ios::cur) {
-        return std::streambuf::seekoff(off, way, which);
+
+    void* map(size_t len, off_t offset) {
+      return ::mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, this->fd, offset);
+    }
+
+    int fd;
+    unsigned features;
+    std::vector<bool> ops;
+    unsigned queued = 0;
+
+    void* sq = MAP_FAILED;
+    void* cq = MAP_FAILED;
+    struct io_uring_sqe* sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    size_t sq_len;
+    size_t cq_len;
+    size_t sqes_len;
+
+    unsigned* sq_tail;
+    unsigned sq_mask;
+    unsigned* sq_array;
+
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe* cqes;
+  };
+
+  // Recycles buffers between the streams of a thread, so that opening
+  // and closing many short-lived streams doesn't churn the allocator.
+  // Buffers are anonymous mappings, so they are page-aligned, and
+  // large ones are eligible for transparent huge pages.
+  class BufferPool {
+  public:
+    BufferPool() = default;
+    BufferPool(const BufferPool& other) = delete;
+    BufferPool(BufferPool&& tmp) = delete;
+
+    ~BufferPool() noexcept {
+      for (const auto& b : this->free) {
+        ::munmap(b.second, b.first);
       }
+      destroyed = true;
+    }
 
-      auto end = this->egptr();
-      auto buffered = end - this->gptr();
-      this->setg(this->eback(), end, end);
-      skip(this->fd, off - buffered);
+    BufferPool& operator=(const BufferPool& other) = delete;
+    BufferPool& operator=(BufferPool&& tmp) = delete;
 
-      return this->gptr() - this->eback();
+    // returns this thread's pool, or nullptr if the thread is exiting
+    // and its pool has already been destroyed
+    static BufferPool* local() {
+      thread_local BufferPool pool;
+      return destroyed ? nullptr : &pool;
     }
 
-    int underflow() override {
-      if (this->gptr() == this->egptr()) {
-        size_t n = read(fd, buf, capacity);
-        this->setg(buf, buf, buf + n);
+    // returns a buffer of at least `n` bytes. `n` is rounded up to the
+    // buffer's actual size
+    char* acquire(size_t& n) {
+      n = round_to_page(n);
+
+      for (auto it = this->free.begin(); it != this->free.end(); ++it) {
+        if (it->first == n) {
+          char* p = it->second;
+          this->free.erase(it);
+          this->cached -= n;
+          return p;
+        }
       }
 
-      return this->gptr() == this->egptr()
-        ? std::char_traits<char>::eof()
-        : std::char_traits<char>::to_int_type(*this->gptr());
+      return allocate(n);
     }
 
-    std::streambuf* setbuf(char* s, std::streamsize n) override {
-      if (this->owned) {
-        delete[] buf;
+    // takes back a buffer obtained from `acquire` (of any thread's pool)
+    void release(char* p, size_t n) noexcept {
+      if (this->free.size() < pool_max_buffers && this->cached + n <= pool_max_bytes) {
+        this->free.emplace_back(n, p);
+        this->cached += n;
+      } else {
+        ::munmap(p, n);
       }
+    }
 
-      this->owned = false;
-      this->buf = s;
-      this->capacity = n;
+    static size_t round_to_page(size_t n) {
+      static const size_t pagesize = ::sysconf(_SC_PAGESIZE);
+      return (n + pagesize - 1) / pagesize * pagesize;
+    }
 
-      return this;
+    // input assertion: n is a multiple of the page size
+    static char* allocate(size_t n) {
+      void* p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        throw std::bad_alloc{};
+      }
+      if (n >= hugepage_size) {
+        ::madvise(p, n, MADV_HUGEPAGE);
+      }
+      return static_cast<char*>(p);
     }
 
   private:
-    Fd fd;
-    char* buf = new char[default_bufsize];
-    size_t capacity = default_bufsize;
-    bool owned = true;
+    static thread_local bool destroyed;
+
+    std::vector<std::pair<size_t, char*>> free;
+    size_t cached = 0;
   };
 
-  fdistream::fdistream(const std::string& pth): buf{new fdbuf(pth)} {
-    this->rdbuf(buf);
+  thread_local bool BufferPool::destroyed = false;
+
+  // allocates a buffer of at least `n` bytes, rounding `n` up to its
+  // actual size. Must be freed with `release_buffer`
+  char* acquire_buffer(size_t& n) {
+    if (BufferPool* pool = BufferPool::local()) {
+      return pool->acquire(n);
+    } else {
+      n = BufferPool::round_to_page(n);
+      return BufferPool::allocate(n);
+    }
   }
 
-  fdistream::fdistream(int fd): buf{new fdbuf(fd)} {
-    this->rdbuf(buf);
+  void release_buffer(char* p, size_t n) noexcept {
+    if (BufferPool* pool = BufferPool::local()) {
+      pool->release(p, n);
+    } else {
+      ::munmap(p, n);
+    }
   }
 
-  fdistream::~fdistream() noexcept {
-    delete buf;
+  // the largest pipe an unprivileged process may ask for
+  // (`/proc/sys/fs/pipe-max-size`), capped at `max_skip_pipesize`
+  size_t pipe_max_size() {
+    static const size_t n = [] {
+      size_t max = skip_pipesize;
+      int fd = ::open("/proc/sys/fs/pipe-max-size", O_RDONLY | O_CLOEXEC);
+      if (fd != -1) {
+        char buf[32];
+        ssize_t len = ::read(fd, buf, sizeof(buf) - 1);
+        if (len > 0) {
+          buf[len] = '\0';
+          max = std::strtoul(buf, nullptr, 10);
+        }
+        ::close(fd);
+      }
+      return std::min(std::max(max, default_bufsize), max_skip_pipesize);
+    }();
+    return n;
+  }
+
+  // tries to resize `p` to hold `n` bytes, which can fail if `n` is over
+  // the (unprivileged) limit. Returns the pipe's resulting size
+  size_t resize(Pipe& p, size_t n) {
+    ::fcntl(p.write, F_SETPIPE_SZ, static_cast<int>(n));
+    int sz = ::fcntl(p.write, F_GETPIPE_SZ);
+    if (sz != -1) {
+      return sz;
+    } else {
+      std::stringstream msg;
+      msg << "error getting pipe size: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+  }
+
+  FdType fdtype(const Fd& fd) {
+    return fd.type;
+  }
+
+  // returns a buffer size that suits `fd`: enough for the kernel's
+  // readahead for files, and a whole pipe/socket buffer otherwise, so
+  // that one `read(2)` can drain everything the kernel has queued
+  size_t preferred_bufsize(const Fd& fd) {
+    size_t n = default_bufsize;
+
+    switch (fd.type) {
+    case FdType::reg:
+      n = std::max(reg_bufsize, fd.blksize);
+      break;
+    case FdType::fifo: {
+      int sz = ::fcntl(fd.fd, F_GETPIPE_SZ);
+      if (sz > 0) {
+        n = sz;
+      }
+      break;
+    }
+    case FdType::sock: {
+      int sz;
+      socklen_t len = sizeof(sz);
+      if (::getsockopt(fd.fd, SOL_SOCKET, SO_RCVBUF, &sz, &len) != -1 && sz > 0) {
+        n = sz;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+
+    return std::min(std::max(n, default_bufsize), max_bufsize);
+  }
+
+  void set_engine(Fd& fd, Engine e) {
+    fd.engine = e;
+  }
+
+  // returns the ring that `fd`'s operations should be submitted to, or
+  // nullptr if they should be plain syscalls
+  Ring* ring_for(const Fd& fd) {
+    return fd.engine == Engine::uring ? Ring::local() : nullptr;
+  }
+
+  Counters& counters(Fd& fd) {
+    return fd.stats;
+  }
+
+  ak::fdstats snapshot(const Fd& fd) {
+    const Counters& c = fd.stats;
+    ak::fdstats s;
+    s.bytes_read = c.bytes_read.get();
+    s.underflows = c.underflows.get();
+    s.reads = c.reads.get();
+    s.seeks = c.seeks.get();
+    s.splices = c.splices.get();
+    s.skipped_seek = c.skipped_seek.get();
+    s.skipped_splice = c.skipped_splice.get();
+    s.skipped_deferred = c.skipped_deferred.get();
+    s.short_reads = c.short_reads.get();
+    s.eintr_retries = c.eintr_retries.get();
+    s.blocked_ns = c.blocked_ns.get();
+    return s;
+  }
+
+  void count_read(Fd& fd, size_t asked, size_t got) {
+    fd.stats.bytes_read.add(got);
+    if (got > 0 && got < asked) {
+      fd.stats.short_reads.add(1);
+    }
+  }
+
+  // returns `would_block` if `fd` is non-blocking and has nothing ready
+  size_t read(Fd& fd, void* buf, size_t count) {
+    Timer t{fd.stats.blocked_ns};
+    ssize_t n;
+
+    if (Ring* ring = ring_for(fd)) {
+      fd.stats.reads.add(1);
+      while ((n = ring->read(fd.fd, buf, count)) < 0) {
+        if (n != -EINTR) {
+          std::stringstream msg;
+          msg << "read error: " << strerror(-n);
+          throw std::runtime_error{msg.str()};
+        }
+        fd.stats.eintr_retries.add(1);
+      }
+      count_read(fd, count, n);
+      return n;
+    }
+
+    fd.stats.reads.add(1);
+    while ((n = ::read(fd.fd, buf, count)) == -1) {
+      if (fd.nonblocking && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return would_block;
+      } else if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "read error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+      fd.stats.eintr_retries.add(1);
+    }
+    count_read(fd, count, n);
+    return n;
+  }
+
+  size_t pread(Fd& fd, void* buf, size_t count, off_t offset) {
+    Timer t{fd.stats.blocked_ns};
+    ssize_t n;
+
+    if (Ring* ring = ring_for(fd)) {
+      fd.stats.reads.add(1);
+      while ((n = ring->read(fd.fd, buf, count, offset)) < 0) {
+        if (n != -EINTR) {
+          std::stringstream msg;
+          msg << "read error: " << strerror(-n);
+          throw std::runtime_error{msg.str()};
+        }
+        fd.stats.eintr_retries.add(1);
+      }
+      count_read(fd, count, n);
+      return n;
+    }
+
+    fd.stats.reads.add(1);
+    while ((n = ::pread(fd.fd, buf, count, offset)) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "read error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+      fd.stats.eintr_retries.add(1);
+    }
+    count_read(fd, count, n);
+    return n;
+  }
+
+  size_t readv(Fd& fd, const struct iovec* iov, int iovcnt) {
+    Timer t{fd.stats.blocked_ns};
+    ssize_t n;
+
+    size_t count = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      count += iov[i].iov_len;
+    }
+
+    if (Ring* ring = ring_for(fd)) {
+      fd.stats.reads.add(1);
+      while ((n = ring->readv(fd.fd, iov, iovcnt)) < 0) {
+        if (n != -EINTR) {
+          std::stringstream msg;
+          msg << "readv error: " << strerror(-n);
+          throw std::runtime_error{msg.str()};
+        }
+        fd.stats.eintr_retries.add(1);
+      }
+      count_read(fd, count, n);
+      return n;
+    }
+
+    fd.stats.reads.add(1);
+    while ((n = ::readv(fd.fd, iov, iovcnt)) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "readv error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+      fd.stats.eintr_retries.add(1);
+    }
+    count_read(fd, count, n);
+    return n;
+  }
+
+  size_t preadv(Fd& fd, const struct iovec* iov, int iovcnt, off_t offset) {
+    Timer t{fd.stats.blocked_ns};
+    ssize_t n;
+
+    size_t count = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+      count += iov[i].iov_len;
+    }
+
+    if (Ring* ring = ring_for(fd)) {
+      fd.stats.reads.add(1);
+      while ((n = ring->readv(fd.fd, iov, iovcnt, offset)) < 0) {
+        if (n != -EINTR) {
+          std::stringstream msg;
+          msg << "readv error: " << strerror(-n);
+          throw std::runtime_error{msg.str()};
+        }
+        fd.stats.eintr_retries.add(1);
+      }
+      count_read(fd, count, n);
+      return n;
+    }
+
+    fd.stats.reads.add(1);
+    while ((n = ::preadv(fd.fd, iov, iovcnt, offset)) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "readv error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+      fd.stats.eintr_retries.add(1);
+    }
+    count_read(fd, count, n);
+    return n;
+  }
+
+  size_t writev(Fd& fd, const struct iovec* iov, int iovcnt) {
+    ssize_t n;
+    while ((n = ::writev(fd.fd, iov, iovcnt)) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "write error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+    }
+    return n;
+  }
+
+  size_t skip(Fd& fd, size_t n) {
+    Timer t{fd.stats.blocked_ns};
+
+    switch (fd.type) {
+    case FdType::reg: {
+      fd.stats.skipped_seek.add(n);
+      lseek(fd, n,  SEEK_CUR);
+      return n;
+    }
+    case FdType::fifo: {
+      grow_for_skip(fd, n);
+      size_t skipped = splice_pipe_to_null(fd, n);
+      fd.stats.skipped_splice.add(skipped);
+      return skipped;
+    }
+    default: {
+      size_t skipped = splice_to_null(fd, n);
+      fd.stats.skipped_splice.add(skipped);
+      return skipped;
+    }
+    }
+  }
+
+  off_t lseek(Fd& fd, off_t offset, int whence) {
+    fd.stats.seeks.add(1);
+    off_t o = ::lseek(fd.fd, offset, whence);
+
+    if (o != -1) {
+      return o;
+    } else {
+      std::stringstream msg;
+      msg << "seek error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+  }
+
+  // page cache hints are only advisory, so failures are ignored
+  void fadvise(Fd& fd, off_t offset, off_t len, int advice) {
+    ::posix_fadvise(fd.fd, offset, len, advice);
+  }
+
+  // makes `will_need` start reading ahead `len` bytes. 0 disables
+  // it
+  void set_readahead(Fd& fd, size_t len) {
+    fd.readahead_len = len;
+  }
+
+  // starts the kernel reading the `set_readahead` bytes at `offset`
+  // into the page cache in the background
+  void will_need(Fd& fd, off_t offset) {
+    if (fd.readahead_len > 0) {
+      fadvise(fd, offset, fd.readahead_len, POSIX_FADV_WILLNEED);
+    }
+  }
+
+  int native(const Fd& fd) {
+    return fd.fd;
+  }
+
+  // turns O_DIRECT on for a stream, or off once the stream is done
+  // with it. Not every filesystem supports it, so returns false if it
+  // couldn't be turned on. The flag is shared by every stream over the
+  // fd (e.g. ranged ones), so it's only turned off after the last of
+  // them, and not at all if it was on before the first
+  bool set_direct(Fd& fd, bool on) {
+    struct users {
+      unsigned streams = 0;
+      bool was_direct = false;
+    };
+    static std::mutex mut;
+    static std::unordered_map<int, users> direct;
+
+    std::lock_guard<std::mutex> l{mut};
+    int flags = ::fcntl(fd.fd, F_GETFL);
+    if (on) {
+      users& u = direct[fd.fd];
+      if (u.streams == 0) {
+        if (flags == -1 || (!(flags & O_DIRECT) && ::fcntl(fd.fd, F_SETFL, flags | O_DIRECT) == -1)) {
+          direct.erase(fd.fd);
+          return false;
+        }
+        u.was_direct = flags & O_DIRECT;
+      }
+      ++u.streams;
+      return true;
+    }
+
+    auto it = direct.find(fd.fd);
+    if (it == direct.end() || --it->second.streams > 0) {
+      return true;
+    }
+    bool was_direct = it->second.was_direct;
+    direct.erase(it);
+    return was_direct || flags == -1 || ::fcntl(fd.fd, F_SETFL, flags & ~O_DIRECT) != -1;
+  }
+
+  // bytes the kernel has ready for reading, or 0 if it won't say
+  std::streamsize queued(Fd& fd) {
+    int n;
+    return ::ioctl(fd.fd, FIONREAD, &n) != -1 ? n : 0;
+  }
+
+  // turns O_NONBLOCK on. Returns whether it already was
+  bool set_nonblocking(Fd& fd) {
+    int flags = ::fcntl(fd.fd, F_GETFL);
+    if (flags == -1 || ::fcntl(fd.fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+      std::stringstream msg;
+      msg << "fcntl error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+    fd.nonblocking = true;
+    return flags & O_NONBLOCK;
+  }
+
+  void clear_nonblocking(Fd& fd) noexcept {
+    int flags = ::fcntl(fd.fd, F_GETFL);
+    if (flags != -1) {
+      ::fcntl(fd.fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    fd.nonblocking = false;
+  }
+
+  off_t size(Fd& fd) {
+    struct stat s;
+    if (::fstat(fd.fd, &s) != -1) {
+      return s.st_size;
+    } else {
+      std::stringstream msg;
+      msg << "fstat error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+  }
+
+  // a `splice(2)` out of a pipe moves at most what the pipe holds, so
+  // the first skip longer than that grows the pipe towards
+  // `pipe_max_size`. That can fail (e.g. once the user's pipes are
+  // over `pipe-user-pages-soft`), which only costs speed
+  void grow_for_skip(Fd& fd, size_t n) {
+    if (fd.grown) {
+      return;
+    }
+
+    int sz = ::fcntl(fd.fd, F_GETPIPE_SZ);
+    if (sz != -1 && n > static_cast<size_t>(sz)) {
+      fd.grown = true;
+      size_t want = std::min(n, pipe_max_size());
+      if (want > static_cast<size_t>(sz)) {
+        ::fcntl(fd.fd, F_SETPIPE_SZ, static_cast<int>(want));
+      }
+    }
+  }
+
+  // input assertion: fd is a pipe and, therefore, can be `splice(2)`d
+  // directly into `/dev/null` in the kernel. Returns the number of
+  // bytes skipped, which is only less than `n` at EOF
+  size_t splice_pipe_to_null(Fd& fd, size_t n) {
+    thread_local Fd dev_null{"/dev/null", O_WRONLY};
+    size_t done = 0;
+
+    while (done < n) {
+      fd.stats.splices.add(1);
+      // the kernel refuses lengths that don't fit in an ssize_t
+      size_t len = std::min<size_t>(n - done, std::numeric_limits<ssize_t>::max());
+      ssize_t read = ::splice(fd.fd, NULL, dev_null.fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (read > 0) {
+        done += read;
+      } else if (read == 0) {
+        break;
+      } else if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "splice_pipe_to_null failed: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      } else {
+        fd.stats.eintr_retries.add(1);
+      }
+    }
+
+    return done;
+  }
+
+  // input assertion: fd is a regular file. Replaces `m` with a mapping
+  // of (up to) `window` bytes starting at the fd's current offset,
+  // which is then advanced past the mapped bytes so that it behaves
+  // as if they had been `read(2)`. Returns the number of bytes
+  // available at `m.data()`, which is 0 at EOF
+  size_t map(Fd& fd, Mapping& m, size_t window) {
+    static const off_t pagesize = ::sysconf(_SC_PAGESIZE);
+
+    m.reset();
+
+    off_t offset = ::lseek(fd.fd, 0, SEEK_CUR);
+    struct stat s;
+    if (offset == -1 || ::fstat(fd.fd, &s) == -1) {
+      std::stringstream msg;
+      msg << "map error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+
+    if (offset >= s.st_size) {
+      return 0;
+    }
+
+    off_t aligned = offset - (offset % pagesize);
+    size_t len = std::min<off_t>(window + (offset - aligned), s.st_size - aligned);
+
+    void* addr = ::mmap(nullptr, len, PROT_READ, MAP_SHARED, fd.fd, aligned);
+    if (addr == MAP_FAILED) {
+      std::stringstream msg;
+      msg << "mmap error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+    ::madvise(addr, len, MADV_SEQUENTIAL);
+
+    m.addr = addr;
+    m.len = len;
+    m.skew = offset - aligned;
+    fd.stats.bytes_read.add(m.size());
+
+    lseek(fd, aligned + len, SEEK_SET);
+
+    return m.size();
+  }
+
+  // This approach works with all fd types because it creates a
+  // (in-kernel) pipe and shuffles data (zero copy) kernel-side. In
+  // effect, it's the same as a traditional `read(2)` + `write(2)`
+  // with the limitation (and benefit) that the data is never copied
+  // to userspace. Returns the number of bytes skipped, which is only
+  // less than `n` at EOF
+  size_t splice_to_null(Fd& fd, size_t n) {
+    thread_local Fd dev_null{"/dev/null", O_WRONLY};
+    thread_local Pipe p;
+    // a bigger pipe moves more per syscall
+    thread_local size_t chunk = resize(p, pipe_max_size());
+
+    Ring* ring = ring_for(fd);
+    if (ring && !ring->supports(IORING_OP_SPLICE)) {
+      ring = nullptr;
+    }
+    size_t done = 0;
+
+    while (done < n) {
+      size_t len = std::min(n - done, chunk);
+      ssize_t read;
+      ssize_t written = 0;
+
+      // an io_uring submission counts as one
+      fd.stats.splices.add(1);
+      if (ring) {
+        // both halves go in one submission. The write is linked to the
+        // read, so it's cancelled if the read comes up short (e.g. less
+        // was available on a socket), and is then redone below
+        ring->splice(fd.fd, p.write, len)->flags |= IOSQE_IO_LINK;
+        ring->splice(p.read, dev_null.fd, len);
+
+        int res[2];
+        ring->submit(res);
+
+        if (res[0] > 0 && res[1] < 0 && res[1] != -ECANCELED) {
+          std::stringstream msg;
+          msg << "splice write failed: " << strerror(-res[1]);
+          throw std::runtime_error{msg.str()};
+        }
+        read = res[0];
+        written = std::max(res[1], 0);
+      } else {
+        read = ::splice(fd.fd, NULL, p.write, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (read == -1) {
+          read = -errno;
+        }
+      }
+
+      if (read == -EINTR || read == -EAGAIN) {
+        fd.stats.eintr_retries.add(read == -EINTR);
+        continue;
+      } else if (read == 0) {
+        break;
+      } else if (read < 0) {
+        std::stringstream msg;
+        msg << "splice1 failed: " << strerror(-read);
+        throw std::runtime_error{msg.str()};
+      }
+
+      // the pipe must be emptied before the next read, or it would
+      // eventually fill up and block it
+      while (written < read) {
+        fd.stats.splices.add(1);
+        // the bytes are already in the pipe, so this can't wait: fail
+        // rather than hang if they somehow aren't
+        ssize_t w = ::splice(p.read, NULL, dev_null.fd, NULL, read - written,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (w != -1) {
+          written += w;
+        } else if (errno != EINTR) {
+          std::stringstream msg;
+          msg << "splice write failed: " << strerror(errno);
+          throw std::runtime_error{msg.str()};
+        }
+      }
+
+      done += read;
+    }
+
+    return done;
+  }
+
+  // writes all of `buf` to `fd`
+  void write_all(Fd& fd, const char* buf, size_t n) {
+    while (n > 0) {
+      struct iovec iov = {const_cast<char*>(buf), n};
+      size_t written = writev(fd, &iov, 1);
+      buf += written;
+      n -= written;
+    }
+  }
+
+  // moves bytes with `splice(2)` through an intermediate pipe, for when
+  // neither end is a pipe and `sendfile(2)` doesn't apply (e.g. socket
+  // to socket). Returns the number of bytes moved, which is only less
+  // than `n` at EOF
+  size_t splice_through_pipe(Fd& in, Fd& out, size_t n) {
+    thread_local Pipe p;
+    thread_local size_t chunk = resize(p, pipe_max_size());
+
+    size_t done = 0;
+    while (done < n) {
+      in.stats.splices.add(1);
+      ssize_t read = ::splice(in.fd, NULL, p.write, NULL, std::min(n - done, chunk),
+                              SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (read == 0) {
+        break;
+      } else if (read == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::stringstream msg;
+        msg << "splice read failed: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+
+      ssize_t written = 0;
+      while (written < read) {
+        in.stats.splices.add(1);
+        ssize_t w = ::splice(p.read, NULL, out.fd, NULL, read - written,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (w != -1) {
+          written += w;
+        } else if (errno != EINTR) {
+          std::stringstream msg;
+          msg << "splice write failed: " << strerror(errno);
+          throw std::runtime_error{msg.str()};
+        }
+      }
+      done += read;
+    }
+
+    return done;
+  }
+
+  // copies up to `n` bytes from `in`'s current offset (or from
+  // `*offset`, advancing it instead, if given) to `out` without them
+  // passing through userspace, using whichever of `splice(2)`,
+  // `copy_file_range(2)` or `sendfile(2)` suits the two fd types.
+  // Returns the number of bytes moved, which is only less than `n` at
+  // EOF
+  size_t forward(Fd& in, Fd& out, size_t n, off_t* offset) {
+    size_t done = 0;
+
+    if (in.type != FdType::fifo && out.type != FdType::fifo && in.type != FdType::reg) {
+      return splice_through_pipe(in, out, n);
+    }
+
+    while (done < n) {
+      size_t len = n - done;
+      ssize_t moved;
+
+      // the calls advance these copies, rather than the fd's offset
+      loff_t lat = offset ? *offset + done : 0;
+      off_t sat = lat;
+
+      in.stats.splices.add(1);
+      if (in.type == FdType::fifo || out.type == FdType::fifo) {
+        moved = ::splice(in.fd, offset && in.type != FdType::fifo ? &lat : NULL, out.fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+      } else if (out.type == FdType::reg) {
+        moved = ::copy_file_range(in.fd, offset ? &lat : NULL, out.fd, NULL, len, 0);
+        if (moved == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS)) {
+          // e.g. across filesystems on older kernels
+          moved = ::sendfile(out.fd, in.fd, offset ? &sat : NULL, len);
+        }
+      } else {
+        moved = ::sendfile(out.fd, in.fd, offset ? &sat : NULL, len);
+      }
+
+      if (moved > 0) {
+        done += moved;
+      } else if (moved == 0) {
+        break;
+      } else if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "forward failed: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+    }
+
+    if (offset) {
+      *offset += done;
+    }
+    return done;
+  }
+
+  // blocks until `fd` has any of `events` or `wake` is written to (see
+  // `wake`). Returns false if woken
+  bool wait_for(int fd, short events, Pipe& wake) {
+    struct pollfd fds[2] = {
+      {fd, events, 0},
+      {wake.read, POLLIN, 0},
+    };
+
+    while (::poll(fds, 2, -1) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "poll error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+    }
+
+    return !(fds[1].revents & POLLIN);
+  }
+
+  bool wait_readable(Fd& fd, Pipe& wake) {
+    return wait_for(fd.fd, POLLIN, wake);
+  }
+
+  void wake(Pipe& p) {
+    char c = 0;
+    while (::write(p.write, &c, 1) == -1 && errno == EINTR) {
+    }
+  }
+
+  // Reads ahead of a consumer on a background thread. The thread
+  // fills free buffers from the fd while the consumer works through
+  // filled ones, so that parsing and I/O overlap. While it runs, the
+  // thread is the only user of the fd.
+  class Prefetcher {
+  public:
+    struct Chunk {
+      char* buf;
+      char* begin;
+      char* end;
+    };
+
+    Prefetcher(Fd& _fd, size_t bufsize, size_t depth): fd{_fd}, size{bufsize} {
+      for (size_t i = 0; i < depth; ++i) {
+        this->bufs.push_back(acquire_buffer(this->size));
+        this->free.push_back(this->bufs.back());
+      }
+      this->worker = std::thread{[this]() { this->run(); }};
+    }
+
+    Prefetcher(const Prefetcher& other) = delete;
+    Prefetcher(Prefetcher&& tmp) = delete;
+
+    ~Prefetcher() noexcept {
+      {
+        std::lock_guard<std::mutex> l{this->mut};
+        this->stopping = true;
+      }
+      this->cv.notify_all();
+      wake(this->waker);
+      this->worker.join();
+
+      for (char* b : this->bufs) {
+        release_buffer(b, this->size);
+      }
+    }
+
+    Prefetcher& operator=(const Prefetcher& other) = delete;
+    Prefetcher& operator=(Prefetcher&& tmp) = delete;
+
+    // releases the chunk previously returned by `next` and blocks
+    // until the next one is filled. Returns an empty chunk at EOF
+    Chunk next() {
+      std::unique_lock<std::mutex> l{this->mut};
+
+      if (this->taken) {
+        this->free.push_back(this->taken);
+        this->taken = nullptr;
+        this->cv.notify_all();
+      }
+
+      this->cv.wait(l, [this]() {
+        return !this->filled.empty() || this->eof || this->error;
+      });
+
+      if (!this->filled.empty()) {
+        Chunk c = this->filled.front();
+        this->filled.pop_front();
+        this->taken = c.buf;
+        return c;
+      } else if (this->error) {
+        std::rethrow_exception(this->error);
+      } else {
+        return {nullptr, nullptr, nullptr};
+      }
+    }
+
+    // discards the next `n` bytes that have not yet been handed out
+    // by `next`. Bytes that haven't been read yet are skipped by the
+    // background thread via `skip`
+    void skip(size_t n) {
+      {
+        std::lock_guard<std::mutex> l{this->mut};
+
+        while (n > 0 && !this->filled.empty()) {
+          Chunk& c = this->filled.front();
+          size_t avail = c.end - c.begin;
+          if (n < avail) {
+            c.begin += n;
+            n = 0;
+          } else {
+            this->free.push_back(c.buf);
+            this->filled.pop_front();
+            n -= avail;
+          }
+        }
+
+        if (!this->eof) {
+          this->pending += n;
+        }
+      }
+      this->cv.notify_all();
+    }
+
+  private:
+    void run() {
+      try {
+        while (true) {
+          char* b;
+          size_t to_skip;
+          {
+            std::unique_lock<std::mutex> l{this->mut};
+            this->cv.wait(l, [this]() {
+              return !this->free.empty() || this->stopping;
+            });
+            if (this->stopping) {
+              return;
+            }
+            b = this->free.back();
+            this->free.pop_back();
+            to_skip = this->pending;
+            this->pending = 0;
+          }
+
+          if (to_skip > 0) {
+            ::skip(this->fd, to_skip);
+          }
+
+          if (!wait_readable(this->fd, this->waker)) {
+            return;
+          }
+          size_t n = read(this->fd, b, this->size);
+
+          {
+            std::lock_guard<std::mutex> l{this->mut};
+            // the consumer may have skipped past data while it was
+            // being read
+            size_t trim = std::min(n, this->pending);
+            this->pending -= trim;
+
+            if (n == 0) {
+              this->free.push_back(b);
+              this->eof = true;
+            } else if (trim == n) {
+              this->free.push_back(b);
+            } else {
+              this->filled.push_back({b, b + trim, b + n});
+            }
+          }
+          this->cv.notify_all();
+
+          if (n == 0) {
+            return;
+          }
+        }
+      } catch (...) {
+        {
+          std::lock_guard<std::mutex> l{this->mut};
+          this->error = std::current_exception();
+        }
+        this->cv.notify_all();
+      }
+    }
+
+    Fd& fd;
+    Pipe waker;
+    size_t size;
+    std::vector<char*> bufs;
+
+    std::mutex mut;
+    std::condition_variable cv;
+    std::vector<char*> free;
+    std::deque<Chunk> filled;
+    char* taken = nullptr;
+    size_t pending = 0;
+    bool eof = false;
+    bool stopping = false;
+    std::exception_ptr error;
+
+    std::thread worker;
+  };
+
+  // a decompressor between the fd and the get area. It reads the fd
+  // through its own (large) input buffer, which starts with the bytes
+  // that were read to sniff the format
+  class Decoder {
+  public:
+    Decoder(Fd& _fd, const char* head, size_t n): fd{_fd}, in_cap{std::max(n, decode_bufsize)} {
+      this->in = acquire_buffer(this->in_cap);
+      std::copy(head, head + n, this->in);
+      this->in_end = n;
+    }
+
+    Decoder(const Decoder& other) = delete;
+    Decoder(Decoder&& tmp) = delete;
+
+    virtual ~Decoder() noexcept {
+      release_buffer(this->in, this->in_cap);
+    }
+
+    Decoder& operator=(const Decoder& other) = delete;
+    Decoder& operator=(Decoder&& tmp) = delete;
+
+    // decompresses up to `n` bytes into `out`. Returns 0 at the end of
+    // the input
+    size_t decompress(char* out, size_t n) {
+      size_t got = this->decode(out, n);
+      this->produced += got;
+      return got;
+    }
+
+    // skips `n` decompressed bytes (fewer at the end of the input),
+    // decompressing into `scratch` unless the format lets it jump.
+    // Returns the number of bytes skipped
+    virtual size_t skip(size_t n, char* scratch, size_t len) {
+      off_t from = this->produced;
+      while (n > 0) {
+        size_t got = this->decompress(scratch, std::min(n, len));
+        if (got == 0) {
+          break;
+        }
+        n -= got;
+      }
+      return this->produced - from;
+    }
+
+    // moves to decompressed offset `target`, if the format has an
+    // index to do it with. Returns false otherwise
+    virtual bool seek(off_t target, char* scratch, size_t len) {
+      (void)target;
+      (void)scratch;
+      (void)len;
+      return false;
+    }
+
+  protected:
+    virtual size_t decode(char* out, size_t n) = 0;
+
+    // refills the input buffer once it has been used up. Returns false
+    // at EOF
+    bool fill_input() {
+      this->in_begin = 0;
+      this->in_end = read(this->fd, this->in, this->in_cap);
+      return this->in_end > 0;
+    }
+
+    [[noreturn]] void truncated(const char* format) {
+      std::stringstream msg;
+      msg << format << " input is truncated";
+      throw std::runtime_error{msg.str()};
+    }
+
+    Fd& fd;
+    char* in;
+    size_t in_cap;
+    size_t in_begin = 0;
+    size_t in_end = 0;
+    // decompressed offset of the next byte
+    off_t produced = 0;
+  };
+
+#ifdef FDSTREAM_ZLIB
+  // gzip (or zlib) input, including concatenated gzip members
+  class GzipDecoder : public Decoder {
+  public:
+    GzipDecoder(Fd& fd, const char* head, size_t n): Decoder{fd, head, n} {
+      // 32: detect the gzip or zlib header
+      if (::inflateInit2(&this->z, 15 + 32) != Z_OK) {
+        throw std::runtime_error{"inflateInit2 failed"};
+      }
+    }
+
+    ~GzipDecoder() noexcept {
+      ::inflateEnd(&this->z);
+    }
+
+  protected:
+    size_t decode(char* out, size_t n) override {
+      this->z.next_out = reinterpret_cast<Bytef*>(out);
+      this->z.avail_out = n;
+
+      while (this->z.avail_out == n && !this->done) {
+        if (this->in_begin == this->in_end && !this->fill_input()) {
+          this->truncated("gzip");
+        }
+        this->z.next_in = reinterpret_cast<Bytef*>(this->in + this->in_begin);
+        this->z.avail_in = this->in_end - this->in_begin;
+
+        int r = ::inflate(&this->z, Z_NO_FLUSH);
+        this->in_begin = this->in_end - this->z.avail_in;
+
+        if (r == Z_STREAM_END) {
+          // another member may follow
+          if (this->in_begin < this->in_end || this->fill_input()) {
+            ::inflateReset(&this->z);
+          } else {
+            this->done = true;
+          }
+        } else if (r != Z_OK) {
+          std::stringstream msg;
+          msg << "gzip error: " << (this->z.msg ? this->z.msg : "inflate failed");
+          throw std::runtime_error{msg.str()};
+        }
+      }
+
+      return n - this->z.avail_out;
+    }
+
+  private:
+    z_stream z{};
+    bool done = false;
+  };
+#endif
+
+#ifdef FDSTREAM_ZSTD
+  // zstd input. If the input is a regular file in the seekable format
+  // (a seek table in a trailing skippable frame), skips and seeks jump
+  // to the frame holding their target rather than decompressing
+  // everything before it
+  class ZstdDecoder : public Decoder {
+  public:
+    ZstdDecoder(Fd& fd, const char* head, size_t n): Decoder{fd, head, n} {
+      if ((this->dctx = ::ZSTD_createDCtx()) == nullptr) {
+        throw std::runtime_error{"ZSTD_createDCtx failed"};
+      }
+      if (fdtype(fd) == FdType::reg) {
+        this->base = lseek(fd, 0, SEEK_CUR) - n;
+        this->load_seek_table();
+      }
+    }
+
+    ~ZstdDecoder() noexcept {
+      ::ZSTD_freeDCtx(this->dctx);
+    }
+
+    size_t skip(size_t n, char* scratch, size_t len) override {
+      off_t from = this->produced;
+      off_t target = from + n;
+      if (this->frames.empty() || this->frame_of(target) == this->frame_of(from)) {
+        Decoder::skip(n, scratch, len);
+      } else {
+        this->seek(target, scratch, len);
+      }
+      return this->produced - from;
+    }
+
+    bool seek(off_t target, char* scratch, size_t len) override {
+      if (this->frames.empty()) {
+        return false;
+      }
+
+      size_t i = this->frame_of(target);
+      lseek(this->fd, this->base + this->frames[i].compressed, SEEK_SET);
+      this->in_begin = this->in_end = 0;
+      ::ZSTD_DCtx_reset(this->dctx, ZSTD_reset_session_only);
+      this->last = 0;
+      this->produced = this->frames[i].decompressed;
+      Decoder::skip(target - this->produced, scratch, len);
+      return true;
+    }
+
+  protected:
+    size_t decode(char* out, size_t n) override {
+      ZSTD_outBuffer o{out, n, 0};
+
+      while (o.pos == 0) {
+        if (this->in_begin == this->in_end && !this->fill_input()) {
+          // `last` is 0 once a frame has been fully decoded and flushed
+          if (this->last != 0) {
+            this->truncated("zstd");
+          }
+          break;
+        }
+
+        ZSTD_inBuffer i{this->in + this->in_begin, this->in_end - this->in_begin, 0};
+        size_t r = ::ZSTD_decompressStream(this->dctx, &o, &i);
+        if (::ZSTD_isError(r)) {
+          std::stringstream msg;
+          msg << "zstd error: " << ::ZSTD_getErrorName(r);
+          throw std::runtime_error{msg.str()};
+        }
+        this->in_begin += i.pos;
+        this->last = r;
+      }
+
+      return o.pos;
+    }
+
+  private:
+    // start of a frame, in the file (from `base`) and in the output
+    struct Frame {
+      off_t compressed;
+      off_t decompressed;
+    };
+
+    static uint32_t le32(const unsigned char* p) {
+      return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+    }
+
+    // reads the seek table, if there is one. `frames` gets an entry per
+    // frame plus one for the end, and stays empty otherwise
+    void load_seek_table() {
+      constexpr uint32_t seekable_magic = 0x8F92EAB1;
+      constexpr size_t footer_size = 9;
+      constexpr size_t header_size = 8;
+
+      off_t end = size(this->fd);
+      unsigned char footer[footer_size];
+      if (end - this->base < static_cast<off_t>(footer_size + header_size) ||
+          pread(this->fd, footer, footer_size, end - footer_size) != footer_size ||
+          le32(footer + 5) != seekable_magic) {
+        return;
+      }
+
+      uint32_t nframes = le32(footer);
+      size_t entry_size = (footer[4] & 0x80) ? 12 : 8;
+      off_t table_size = static_cast<off_t>(nframes) * entry_size;
+      if (end - this->base < static_cast<off_t>(footer_size + header_size) + table_size) {
+        return;
+      }
+
+      std::vector<unsigned char> table(table_size);
+      if (pread(this->fd, table.data(), table_size, end - footer_size - table_size) !=
+          static_cast<size_t>(table_size)) {
+        return;
+      }
+
+      Frame f{0, 0};
+      for (uint32_t i = 0; i < nframes; ++i) {
+        this->frames.push_back(f);
+        f.compressed += le32(table.data() + i * entry_size);
+        f.decompressed += le32(table.data() + i * entry_size + 4);
+      }
+      this->frames.push_back(f);
+    }
+
+    // index of the frame holding decompressed offset `off` (the end
+    // entry for offsets past the last frame)
+    size_t frame_of(off_t off) const {
+      auto it = std::upper_bound(this->frames.begin(), this->frames.end(), off,
+                                 [](off_t o, const Frame& f) { return o < f.decompressed; });
+      return it == this->frames.begin() ? 0 : (it - this->frames.begin()) - 1;
+    }
+
+    ZSTD_DCtx* dctx;
+    size_t last = 0;
+    off_t base = 0;
+    std::vector<Frame> frames;
+  };
+#endif
+
+#ifdef FDSTREAM_LZ4
+  // lz4 frame format input, including concatenated frames
+  class Lz4Decoder : public Decoder {
+  public:
+    Lz4Decoder(Fd& fd, const char* head, size_t n): Decoder{fd, head, n} {
+      if (LZ4F_isError(::LZ4F_createDecompressionContext(&this->dctx, LZ4F_VERSION))) {
+        throw std::runtime_error{"LZ4F_createDecompressionContext failed"};
+      }
+    }
+
+    ~Lz4Decoder() noexcept {
+      ::LZ4F_freeDecompressionContext(this->dctx);
+    }
+
+  protected:
+    size_t decode(char* out, size_t n) override {
+      size_t produced = 0;
+
+      while (produced == 0) {
+        if (this->in_begin == this->in_end && !this->fill_input()) {
+          // the hint is 0 once a frame has been fully decoded
+          if (this->hint != 0) {
+            this->truncated("lz4");
+          }
+          break;
+        }
+
+        size_t dst_len = n;
+        size_t src_len = this->in_end - this->in_begin;
+        size_t r = ::LZ4F_decompress(this->dctx, out, &dst_len,
+                                     this->in + this->in_begin, &src_len, nullptr);
+        if (LZ4F_isError(r)) {
+          std::stringstream msg;
+          msg << "lz4 error: " << ::LZ4F_getErrorName(r);
+          throw std::runtime_error{msg.str()};
+        }
+        this->in_begin += src_len;
+        this->hint = r;
+        produced = dst_len;
+      }
+
+      return produced;
+    }
+
+  private:
+    LZ4F_dctx* dctx;
+    size_t hint = 0;
+  };
+#endif
+
+  // reads enough of `fd` to recognise a compression format's magic
+  // number into `buf`, returning the number of bytes read
+  size_t sniff(Fd& fd, char* buf, size_t len) {
+    constexpr size_t magic_len = 4;
+
+    size_t got = 0;
+    while (got < magic_len) {
+      size_t n = read(fd, buf + got, len - got);
+      if (n == 0) {
+        break;
+      }
+      got += n;
+    }
+    return got;
+  }
+
+  // returns a decoder for the format `head` starts with, or nullptr if
+  // it doesn't look compressed
+  std::unique_ptr<Decoder> make_decoder([[maybe_unused]] Fd& fd, const char* head, size_t n) {
+    const char* format = nullptr;
+    auto starts_with = [head, n](const char* magic, size_t len) {
+      return n >= len && std::memcmp(head, magic, len) == 0;
+    };
+
+    if (starts_with("\x1f\x8b", 2)) {
+#ifdef FDSTREAM_ZLIB
+      return std::unique_ptr<Decoder>{new GzipDecoder(fd, head, n)};
+#endif
+      format = "gzip";
+    } else if (starts_with("\x28\xb5\x2f\xfd", 4)) {
+#ifdef FDSTREAM_ZSTD
+      return std::unique_ptr<Decoder>{new ZstdDecoder(fd, head, n)};
+#endif
+      format = "zstd";
+    } else if (starts_with("\x04\x22\x4d\x18", 4)) {
+#ifdef FDSTREAM_LZ4
+      return std::unique_ptr<Decoder>{new Lz4Decoder(fd, head, n)};
+#endif
+      format = "lz4";
+    } else {
+      return nullptr;
+    }
+
+    std::stringstream msg;
+    msg << "input is " << format << "-compressed, but fdstream was built without support for it";
+    throw std::runtime_error{msg.str()};
+  }
+
+  // offset just past the first `delim` that starts at or after `from`,
+  // or `end` if there isn't one
+  off_t after_delim(Fd& fd, off_t from, off_t end, std::string_view delim) {
+    if (delim.empty()) {
+      return from;
+    }
+
+    std::vector<char> chunk(split_chunk + delim.size());
+    while (from < end) {
+      size_t n = pread(fd, chunk.data(), std::min<off_t>(chunk.size(), end - from), from);
+      if (n < delim.size()) {
+        break;
+      }
+
+      size_t i = std::string_view{chunk.data(), n}.find(delim);
+      if (i != std::string_view::npos) {
+        return from + i + delim.size();
+      }
+      // a `delim` may straddle chunks
+      from += n - (delim.size() - 1);
+    }
+
+    return end;
+  }
+
+  // A sparse index of `delim`-terminated records: the offsets of
+  // every `every`th record start, or sooner if `every_bytes` have
+  // gone by. It's fed the stream's bytes as they pass through the
+  // buffer, but only counts them while they carry on from where it
+  // left off, so bytes that are skipped over leave it where it was.
+  // Past `max_index_entries`, every other entry is dropped and the
+  // spacing doubled, which bounds its size
+  class RecordIndex {
+  public:
+    struct Entry {
+      uint64_t record;
+      uint64_t offset;
+    };
+
+    RecordIndex(char delim, size_t every, size_t every_bytes, off_t start):
+      delim{delim}, every{std::max<size_t>(every, 1)}, every_bytes{std::max<size_t>(every_bytes, 1)},
+      entries{{0, static_cast<uint64_t>(start)}}, last{entries.back()}, seen{start} {
+    }
+
+    char delimiter() const {
+      return this->delim;
+    }
+
+    // counts the records in the `n` bytes at `p`, which are at stream
+    // offset `off`
+    void feed(const char* p, size_t n, off_t off) {
+      if (off > this->seen || off + static_cast<off_t>(n) <= this->seen) {
+        return;
+      }
+
+      const char* q = p + (this->seen - off);
+      const char* end = p + n;
+      while ((q = static_cast<const char*>(std::memchr(q, this->delim, end - q))) != nullptr) {
+        ++q;
+        this->last = {this->last.record + 1, static_cast<uint64_t>(off + (q - p))};
+        const Entry& prev = this->entries.back();
+        if (this->last.record - prev.record >= this->every ||
+            this->last.offset - prev.offset >= this->every_bytes) {
+          this->entries.push_back(this->last);
+          if (this->entries.size() > max_index_entries) {
+            this->thin();
+          }
+        }
+      }
+      this->seen = off + n;
+    }
+
+    // the known record start closest before (or at) record `n`
+    Entry nearest(uint64_t n) const {
+      if (n >= this->last.record) {
+        return this->last;
+      }
+      auto it = std::upper_bound(this->entries.begin(), this->entries.end(), n,
+                                 [](uint64_t r, const Entry& e) { return r < e.record; });
+      return *(it - 1);
+    }
+
+    // writes the index to `pth`, stamped with `src`'s size and mtime
+    void save(const std::string& pth, Fd& src) const {
+      Fd out{pth, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC};
+      Header h = this->header(src);
+      write_all(out, reinterpret_cast<const char*>(&h), sizeof(h));
+      write_all(out, reinterpret_cast<const char*>(this->entries.data()),
+                this->entries.size() * sizeof(Entry));
+    }
+
+    // reads an index written by `save`, if it was stamped with `src`'s
+    // current size and mtime. Returns nullptr otherwise
+    static std::unique_ptr<RecordIndex> load(const std::string& pth, Fd& src) {
+      if (::access(pth.c_str(), R_OK) == -1) {
+        return nullptr;
+      }
+      Fd in{pth, O_RDONLY | O_CLOEXEC};
+      Header h;
+      if (!read_exactly(in, &h, sizeof(h))) {
+        return nullptr;
+      }
+
+      Header now{};
+      stamp(src, now);
+      if (std::memcmp(h.magic, now.magic, sizeof(h.magic)) != 0 ||
+          h.size != now.size || h.mtime_ns != now.mtime_ns ||
+          h.entries == 0 || h.entries > max_index_entries + 1) {
+        return nullptr;
+      }
+
+      std::unique_ptr<RecordIndex> idx{new RecordIndex{h.delim, h.every, h.every_bytes, 0}};
+      idx->entries.resize(h.entries);
+      if (!read_exactly(in, idx->entries.data(), h.entries * sizeof(Entry))) {
+        return nullptr;
+      }
+      idx->last = {h.last_record, h.last_offset};
+      idx->seen = h.seen;
+      return idx;
+    }
+
+  private:
+    // the sidecar file's header, in native byte order
+    struct Header {
+      char magic[8];
+      uint64_t size;
+      uint64_t mtime_ns;
+      uint64_t every;
+      uint64_t every_bytes;
+      uint64_t entries;
+      uint64_t last_record;
+      uint64_t last_offset;
+      int64_t seen;
+      char delim;
+    };
+
+    // what identifies the file an index was built for
+    static void stamp(Fd& src, Header& h) {
+      struct stat s;
+      if (::fstat(native(src), &s) == -1) {
+        std::stringstream msg;
+        msg << "fstat error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+
+      std::memcpy(h.magic, "fdsidx1", sizeof(h.magic));
+      h.size = s.st_size;
+      h.mtime_ns = static_cast<uint64_t>(s.st_mtim.tv_sec) * 1000000000 + s.st_mtim.tv_nsec;
+    }
+
+    Header header(Fd& src) const {
+      Header h{};
+      stamp(src, h);
+      h.every = this->every;
+      h.every_bytes = this->every_bytes;
+      h.entries = this->entries.size();
+      h.last_record = this->last.record;
+      h.last_offset = this->last.offset;
+      h.seen = this->seen;
+      h.delim = this->delim;
+      return h;
+    }
+
+    static bool read_exactly(Fd& fd, void* dst, size_t n) {
+      char* p = static_cast<char*>(dst);
+      while (n > 0) {
+        size_t got = read(fd, p, n);
+        if (got == 0) {
+          return false;
+        }
+        p += got;
+        n -= got;
+      }
+      return true;
+    }
+
+    void thin() {
+      size_t kept = 0;
+      for (size_t i = 0; i < this->entries.size(); i += 2) {
+        this->entries[kept++] = this->entries[i];
+      }
+      this->entries.resize(kept);
+      this->every *= 2;
+      this->every_bytes *= 2;
+    }
+
+    char delim;
+    size_t every;
+    size_t every_bytes;
+    std::vector<Entry> entries;
+    Entry last;
+    off_t seen;
+  };
+}
+
+namespace ak {
+  fdstats& fdstats::operator+=(const fdstats& o) {
+    this->bytes_read += o.bytes_read;
+    this->underflows += o.underflows;
+    this->reads += o.reads;
+    this->seeks += o.seeks;
+    this->splices += o.splices;
+    this->skipped_seek += o.skipped_seek;
+    this->skipped_splice += o.skipped_splice;
+    this->skipped_deferred += o.skipped_deferred;
+    this->short_reads += o.short_reads;
+    this->eintr_retries += o.eintr_retries;
+    this->blocked_ns += o.blocked_ns;
+    return *this;
+  }
+
+  class fdbuf : public std::streambuf {
+  public:
+    fdbuf(const std::string& pth, fdistream::mode m): fd{pth} {
+      this->init(m);
+    }
+
+    fdbuf(int _fd, fdistream::mode m): fd{_fd} {
+      this->init(m);
+    }
+
+    // reads only [begin, end) of a regular file, with `pread(2)`, so
+    // the fd's offset is neither used nor moved
+    fdbuf(int _fd, off_t begin, off_t end, fdistream::mode m): fd{_fd} {
+      if (fdtype(fd) != FdType::reg) {
+        std::stringstream msg;
+        msg << "fd " << _fd << ": byte ranges can only be read from regular files";
+        throw std::runtime_error{msg.str()};
+      }
+      this->positional = true;
+      this->limit = end;
+      this->init(m & (fdistream::uring | fdistream::direct));
+      this->pos = begin;
+    }
+
+    fdbuf(const fdbuf& other) = delete;
+    fdbuf(fdbuf&& tmp) = delete;
+
+    ~fdbuf() noexcept {
+      closed_stats += snapshot(fd);
+      // the fd may outlive the stream, and its flags are shared with
+      // every other holder of the file description (e.g. a shell's
+      // stdin)
+      if (this->odirect) {
+        set_direct(fd, false);
+      }
+      if (this->nonblocking && !this->was_nonblocking) {
+        clear_nonblocking(fd);
+      }
+      if (this->owned) {
+        release_buffer(this->buf, this->capacity);
+      }
+    }
+
+    fdbuf& operator=(const fdbuf& other) = delete;
+    fdbuf& operator=(fdbuf&& tmp) = delete;
+
+    std::streamsize xsgetn(char* s, std::streamsize n) override {
+      std::streamsize rem = n;
+
+      while (rem > 0) {
+        if (this->gptr() == this->egptr()) {
+          if (static_cast<size_t>(rem) >= this->capacity && this->plain() && !this->index) {
+            // large reads bypass the buffer: read straight into the
+            // caller's memory and let the buffer pick up whatever
+            // follows, so that the next small read needn't syscall
+            struct iovec iov[2] = {
+              {s, static_cast<size_t>(rem)},
+              {this->buf, this->capacity},
+            };
+            this->clear_get_area();
+            size_t got;
+            if (this->positional) {
+              off_t left = std::max<off_t>(this->limit - this->pos, 0);
+              iov[0].iov_len = std::min<off_t>(iov[0].iov_len, left);
+              iov[1].iov_len = std::min<off_t>(iov[1].iov_len, left - iov[0].iov_len);
+              got = iov[0].iov_len > 0 ? preadv(fd, iov, 2, this->pos) : 0;
+            } else {
+              this->flush_skip();
+              got = readv(fd, iov, 2);
+            }
+            this->pos += got;
+            if (got == 0) {
+              return n - rem;
+            } else if (got <= static_cast<size_t>(rem)) {
+              s += got;
+              rem -= got;
+            } else {
+              this->setg(this->buf, this->buf, this->buf + (got - rem));
+              rem = 0;
+            }
+            continue;
+          }
+
+          if (this->refill() == std::char_traits<char>::eof()) {
+            return n - rem;
+          }
+        }
+
+        auto avail = this->egptr() - this->gptr();
+        auto amt = std::min(rem, avail);
+
+        std::copy(this->gptr(), this->gptr() + amt, s);
+        this->setg(this->eback(), this->gptr() + amt, this->egptr());
+        s += amt;
+        rem -= amt;
+      }
+
+      return n - rem;
+    }
+    std::streampos seekoff(std::streamoff off,
+                           std::ios::seekdir way,
+                           std::ios::openmode which = std::ios::in | std::ios::out) override {
+      if (!(which & std::ios::in)) {
+        return std::streampos(std::streamoff(-1));
+      }
+      this->index_buffer();
+
+      // `pos` is the stream offset of `egptr()`
+      off_t end = this->pos;
+      off_t begin = end - (this->egptr() - this->eback());
+      off_t target;
+      switch (way) {
+      case std::ios::beg:
+        target = off;
+        break;
+      case std::ios::cur:
+        target = end - (this->egptr() - this->gptr()) + off;
+        break;
+      default:
+        if (fdtype(fd) != FdType::reg || this->decoder) {
+          return std::streampos(std::streamoff(-1));
+        }
+        target = this->end_offset() + off;
+        break;
+      }
+      if (target < 0) {
+        return std::streampos(std::streamoff(-1));
+      }
+
+      if (target >= begin && target <= end) {
+        // seeks that land in the get area (including backwards, over
+        // bytes already extracted from it) are just pointer arithmetic
+        this->setg(this->eback(), this->egptr() - (end - target), this->egptr());
+      } else if (target > end) {
+        // This optimization is specifically for seeking forward
+        this->clear_get_area();
+        this->skip_unbuffered(target - end);
+      } else if (this->decoder) {
+        if (!this->decoder->seek(target, this->buf, this->capacity)) {
+          return std::streampos(std::streamoff(-1));
+        }
+        this->pos = target;
+        this->setg(this->buf, this->buf, this->buf);
+      } else if (fdtype(fd) == FdType::reg) {
+        this->prefetcher.reset();
+        if (!this->odirect && !this->positional) {
+          lseek(fd, target, SEEK_SET);
+        }
+        this->pending_skip = 0;
+        this->pos = target;
+        this->setg(this->buf, this->buf, this->buf);
+      } else {
+        return std::streampos(std::streamoff(-1));
+      }
+
+      return target;
+    }
+
+    std::streampos seekpos(std::streampos p,
+                           std::ios::openmode which = std::ios::in | std::ios::out) override {
+      return this->seekoff(std::streamoff(p), std::ios::beg, which);
+    }
+
+    int underflow() override {
+      return this->refill();
+    }
+
+    // `sbumpc` without the second virtual call the default makes (to
+    // `underflow`) when the get area is empty
+    int uflow() override {
+      if (this->refill() == std::char_traits<char>::eof()) {
+        return std::char_traits<char>::eof();
+      }
+      int c = std::char_traits<char>::to_int_type(*this->gptr());
+      this->gbump(1);
+      return c;
+    }
+
+    // what can be read, or is queued in the kernel, beyond the get
+    // area: the rest of a regular file, or what `FIONREAD` reports for
+    // pipes, sockets and ttys. -1 means the next read would hit EOF, 0
+    // that it's unknown
+    std::streamsize showmanyc() override {
+      if (this->decoder) {
+        return 0;
+      } else if (fdtype(fd) == FdType::reg) {
+        off_t rem = this->end_offset() - this->pos;
+        return rem > 0 ? rem : -1;
+      } else if (this->prefetching) {
+        return 0;
+      }
+
+      std::streamsize n = queued(fd) - this->pending_skip;
+      return std::max<std::streamsize>(n, 0);
+    }
+
+    std::streambuf* setbuf(char* s, std::streamsize n) override {
+      // O_DIRECT needs aligned buffers
+      if (this->odirect) {
+        return this;
+      }
+
+      // unread bytes move to the new buffer (a mapped window or a
+      // prefetched chunk stays where it is)
+      bool in_buf = this->eback() == this->buf;
+      size_t avail = 0;
+      if (in_buf) {
+        avail = this->egptr() - this->gptr();
+        if (n < 0 || static_cast<size_t>(n) < avail) {
+          return nullptr;
+        }
+        this->index_buffer();
+        if (avail > 0) {
+          std::memmove(s, this->gptr(), avail);
+        }
+      }
+
+      if (this->owned) {
+        release_buffer(this->buf, this->capacity);
+      }
+
+      this->owned = false;
+      this->buf = s;
+      this->capacity = n;
+      if (in_buf) {
+        this->setg(this->buf, this->buf, this->buf + avail);
+      }
+
+      return this;
+    }
+
+    // makes (up to) `n` bytes available contiguously in the get area,
+    // compacting or growing the buffer if they aren't already. The
+    // returned view is shorter than `n` only at EOF
+    std::string_view peek(size_t n) {
+      size_t avail = this->egptr() - this->gptr();
+      if (avail >= n) {
+        return {this->gptr(), n};
+      }
+      this->index_buffer();
+
+      if (this->mapped) {
+        // rewind to the first unconsumed byte (or go on to the end of
+        // any pending skip, which leaves nothing buffered) and map a
+        // window that starts there
+        counters(fd).skipped_seek.add(this->pending_skip);
+        lseek(fd, static_cast<off_t>(this->pending_skip) - static_cast<off_t>(avail), SEEK_CUR);
+        this->pending_skip = 0;
+        size_t got = map(fd, window, std::max<size_t>(n, default_mapsize));
+        this->setg(window.data(), window.data(), window.data() + got);
+        this->pos += got - avail;
+        return {this->gptr(), std::min<size_t>(n, got)};
+      }
+
+      if (this->odirect) {
+        // re-read from the start of the block holding the first
+        // unconsumed byte, rather than trying to align around the
+        // bytes that are already buffered
+        this->pos -= avail;
+        this->setg(this->buf, this->buf, this->buf);
+        this->fill_aligned(n);
+        avail = this->egptr() - this->gptr();
+        return {this->gptr(), std::min(n, avail)};
+      }
+
+      if (this->pending_skip > 0 && !this->nonblocking) {
+        // so that a small skip is read along with the bytes after it
+        // (the get area is empty)
+        this->refill();
+        avail = this->egptr() - this->gptr();
+        if (avail >= n || avail == 0) {
+          return {this->gptr(), std::min(n, avail)};
+        }
+      }
+
+      this->compact(n);
+
+      while (avail < n) {
+        if (this->prefetching) {
+          // chunks belong to the prefetcher, so have to be gathered
+          auto c = this->prefetch().next();
+          size_t got = c.end - c.begin;
+          if (got == 0) {
+            break;
+          }
+          this->compact(avail + got);
+          std::copy(c.begin, c.end, this->egptr());
+          avail += got;
+          this->pos += got;
+        } else if (this->nonblocking) {
+          // also handles pending skips
+          if (this->fill_nonblocking() <= 0) {
+            break;
+          }
+          avail = this->egptr() - this->gptr();
+        } else if (this->decoder) {
+          size_t got = this->decoder->decompress(this->egptr(), this->capacity - avail);
+          if (got == 0) {
+            break;
+          }
+          avail += got;
+          this->pos += got;
+        } else {
+          this->flush_skip();
+          size_t got = this->positional
+            ? this->read_at_pos(this->egptr(), this->capacity - avail)
+            : read(fd, this->egptr(), this->capacity - avail);
+          if (got == 0) {
+            break;
+          }
+          avail += got;
+          this->pos += got;
+        }
+        this->setg(this->buf, this->buf, this->buf + avail);
+      }
+
+      return {this->gptr(), std::min(n, avail)};
+    }
+
+    // extracts up to and including the next `delim`, reading (and
+    // compacting or growing the buffer) until it turns up. At EOF, the
+    // rest of the stream is extracted instead. If a non-blocking fd has
+    // nothing ready, nothing is extracted and the view is empty
+    std::string_view scan(char delim) {
+      size_t searched = 0;
+
+      for (;;) {
+        size_t avail = this->egptr() - this->gptr();
+        // (at EOF, a mapped get area is empty and null)
+        const void* p = avail > searched ? std::memchr(this->gptr() + searched, delim, avail - searched) : nullptr;
+        if (p != nullptr) {
+          size_t len = static_cast<const char*>(p) - this->gptr() + 1;
+          std::string_view line{this->gptr(), len};
+          this->setg(this->eback(), this->gptr() + len, this->egptr());
+          return line;
+        }
+        searched = avail;
+
+        // regular files can't block, so ask for plenty more (mappings
+        // and O_DIRECT reads then grow geometrically, too); anything
+        // else might not have more than the record yet
+        size_t want = fdtype(fd) == FdType::reg ? 2 * avail + 1 : avail + 1;
+        if (this->peek(want).size() == avail) {
+          if (this->blocked) {
+            return {};
+          }
+          std::string_view rest{this->gptr(), avail};
+          this->setg(this->eback(), this->egptr(), this->egptr());
+          return rest;
+        }
+      }
+    }
+
+    // writes the next `n` bytes to `out`: first whatever is buffered,
+    // then the rest straight from the fd (see `forward`). Returns the
+    // number of bytes written, which is less than `n` only at EOF
+    size_t forward_to(int out_fd, size_t n) {
+      Fd out{out_fd};
+      size_t done = 0;
+
+      while (done < n) {
+        size_t avail = this->egptr() - this->gptr();
+        if (avail > 0) {
+          size_t len = std::min(n - done, avail);
+          write_all(out, this->gptr(), len);
+          this->setg(this->eback(), this->gptr() + len, this->egptr());
+          done += len;
+        } else if (!this->plain() && !this->mapped) {
+          // the fd belongs to the prefetcher, O_DIRECT's alignment rules
+          // apply, the fd may not be ready, or its bytes need decoding,
+          // so copy through the get area
+          if (this->refill() == std::char_traits<char>::eof()) {
+            break;
+          }
+        } else {
+          this->clear_get_area();
+          size_t moved;
+          if (this->positional) {
+            off_t at = this->pos;
+            moved = forward(this->fd, out, std::min<off_t>(n - done, std::max<off_t>(this->limit - at, 0)), &at);
+          } else {
+            this->flush_skip();
+            moved = forward(this->fd, out, n - done, nullptr);
+          }
+          this->pos += moved;
+          done += moved;
+          break;
+        }
+      }
+
+      return done;
+    }
+
+    void advise(fdistream::access a, bool drop) {
+      if (fdtype(fd) != FdType::reg) {
+        return;
+      }
+
+      switch (a) {
+      case fdistream::access::normal:
+      case fdistream::access::skipping:
+        fadvise(fd, 0, 0, POSIX_FADV_NORMAL);
+        break;
+      case fdistream::access::sequential:
+        fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        break;
+      case fdistream::access::random:
+        fadvise(fd, 0, 0, POSIX_FADV_RANDOM);
+        break;
+      }
+      set_readahead(fd, a == fdistream::access::skipping ? skip_readahead_bufs * this->capacity : 0);
+
+      this->dropping = drop;
+      this->dropped = this->pos - (this->egptr() - this->eback());
+    }
+
+    // reads whatever the fd has ready onto the end of the get area,
+    // keeping the unread bytes. Returns the number of bytes added, 0 at
+    // EOF or -1 if nothing was ready. Streams that aren't non-blocking
+    // block until there is something to add
+    std::streamsize fill_nonblocking() {
+      size_t avail = this->egptr() - this->gptr();
+
+      if (!this->nonblocking) {
+        return this->peek(avail + 1).size() - avail;
+      }
+
+      this->compact(avail + 1);
+      for (;;) {
+        size_t got = read(fd, this->egptr(), this->capacity - avail);
+        if (got == would_block) {
+          this->blocked = true;
+          return -1;
+        }
+        this->blocked = false;
+        if (got == 0) {
+          return 0;
+        }
+
+        // skips that couldn't be done without blocking are done here,
+        // now that the bytes have arrived (`pos` already counts them)
+        size_t skipped = std::min(got, this->pending_skip);
+        this->pending_skip -= skipped;
+        got -= skipped;
+        std::memmove(this->egptr(), this->egptr() + skipped, got);
+        this->setg(this->buf, this->buf, this->buf + avail + got);
+        this->pos += got;
+        if (got > 0) {
+          return got;
+        }
+      }
+    }
+
+    int native_fd() const {
+      return native(this->fd);
+    }
+
+    fdstats stats() const {
+      return snapshot(this->fd);
+    }
+
+    // number of bytes readable without touching the fd
+    size_t ready() const {
+      return this->egptr() - this->gptr();
+    }
+
+    // true if the last read found nothing ready on a non-blocking fd
+    bool is_blocked() const {
+      return this->blocked;
+    }
+
+    // discards the next `n` bytes, skipping what isn't buffered
+    void consume(size_t n) {
+      size_t avail = this->egptr() - this->gptr();
+      if (n <= avail) {
+        this->setg(this->eback(), this->gptr() + n, this->egptr());
+        return;
+      }
+
+      this->clear_get_area();
+      size_t rem = n - avail;
+      if (rem >= this->capacity && fdtype(fd) == FdType::reg && !this->decoder) {
+        // stops at EOF: far enough past the end, the offset can't be
+        // seeked to (short skips aren't worth the `fstat` to check)
+        rem = std::min<size_t>(rem, std::max<off_t>(this->end_offset() - this->pos, 0));
+      }
+      // `pos` counts the skipped bytes, so can't go past the largest offset
+      rem = std::min<size_t>(rem, std::numeric_limits<off_t>::max() - this->pos);
+      this->skip_unbuffered(rem);
+    }
+
+    // for `fdstream_set`'s batched reads: if the next refill would be a
+    // single `read(2)` into the (empty) buffer, returns the buffer and
+    // sets `len` to its size, so that the read can be done elsewhere
+    // and handed to `read_done`. Returns nullptr otherwise
+    char* read_target(size_t& len) {
+      if (this->gptr() != this->egptr() || this->pending_skip > 0 || this->positional ||
+          !(this->plain() || this->nonblocking)) {
+        return nullptr;
+      }
+      // what `refill` does before reading
+      this->index_buffer();
+      if (!this->nonblocking) {
+        this->maybe_grow();
+      }
+      len = this->capacity;
+      return this->buf;
+    }
+
+    // takes the result of a read into `read_target`'s buffer (a byte
+    // count, or a negated errno). Returns what `fill_nonblocking` would
+    std::streamsize read_done(int res) {
+      counters(fd).underflows.add(1);
+      counters(fd).reads.add(1);
+      if (res == -EAGAIN || res == -EWOULDBLOCK) {
+        this->blocked = true;
+        return -1;
+      } else if (res < 0) {
+        std::stringstream msg;
+        msg << "read error: " << strerror(-res);
+        throw std::runtime_error{msg.str()};
+      }
+
+      count_read(fd, this->capacity, res);
+      this->blocked = false;
+      this->setg(this->buf, this->buf, this->buf + res);
+      this->pos += res;
+      // and after
+      if (!this->nonblocking) {
+        this->full_reads = static_cast<size_t>(res) == this->capacity ? this->full_reads + 1 : 0;
+      }
+      if (this->dropping) {
+        this->drop_consumed();
+      }
+      return res;
+    }
+
+    // `consume`, but finding out where the input ends: returns the
+    // number of bytes discarded, which is less than `n` only at EOF. On
+    // a non-blocking fd, what hasn't arrived yet is left pending
+    size_t discard(size_t n) {
+      size_t avail = this->egptr() - this->gptr();
+      if (n <= avail) {
+        this->setg(this->eback(), this->gptr() + n, this->egptr());
+        return n;
+      }
+
+      this->clear_get_area();
+      size_t rem = n - avail;
+
+      if (this->decoder) {
+        size_t got = this->decoder->skip(rem, this->buf, this->capacity);
+        this->setg(this->buf, this->buf, this->buf);
+        this->pos += got;
+        return avail + got;
+      } else if (fdtype(fd) == FdType::reg) {
+        // the end is known, so the skip itself can still be deferred
+        off_t end = this->end_offset();
+        rem = std::min<size_t>(rem, std::max<off_t>(end - this->pos, 0));
+        this->skip_unbuffered(rem);
+        return avail + rem;
+      } else if (this->nonblocking || this->prefetching) {
+        // only reads can tell where these end
+        size_t done = avail;
+        while (rem > 0 && this->refill() != std::char_traits<char>::eof()) {
+          size_t len = std::min<size_t>(rem, this->egptr() - this->gptr());
+          this->setg(this->eback(), this->gptr() + len, this->egptr());
+          done += len;
+          rem -= len;
+        }
+        if (rem > 0 && this->blocked) {
+          // not EOF, just nothing ready yet: the rest is dropped as it
+          // arrives, as with `consume`
+          this->skip_unbuffered(rem);
+          done += rem;
+        }
+        return done;
+      }
+
+      this->flush_skip();
+      size_t got = skip(this->fd, rem);
+      this->pos += got;
+      return avail + got;
+    }
+
+    void build_index(char delim, size_t every, size_t every_bytes) {
+      off_t at = this->pos - (this->egptr() - this->gptr());
+      this->index.reset(new RecordIndex{delim, every, every_bytes, at});
+    }
+
+    // moves to the start of record `n`: to the closest record the
+    // index knows of, then on through the records after it (which
+    // extends the index if they're past its end). Returns false if
+    // there are fewer records, or the stream can't seek
+    bool seek_record(uint64_t n) {
+      if (!this->index) {
+        return false;
+      }
+      this->index_buffer();
+
+      RecordIndex::Entry e = this->index->nearest(n);
+      if (this->seekoff(e.offset, std::ios::beg, std::ios::in) == std::streampos(std::streamoff(-1))) {
+        return false;
+      }
+
+      char delim = this->index->delimiter();
+      for (uint64_t r = e.record; r < n; ++r) {
+        std::string_view rec = this->scan(delim);
+        if (rec.empty() || rec.back() != delim) {
+          return false;
+        }
+      }
+      // and record `n` must have something in it
+      return this->sgetc() != traits_type::eof();
+    }
+
+    void save_index(const std::string& pth) {
+      if (!this->index) {
+        throw std::runtime_error{"no index to save"};
+      }
+      this->index_buffer();
+      this->index->save(pth, this->fd);
+    }
+
+    bool load_index(const std::string& pth) {
+      std::unique_ptr<RecordIndex> idx = RecordIndex::load(pth, this->fd);
+      if (!idx) {
+        return false;
+      }
+      this->index = std::move(idx);
+      return true;
+    }
+
+  private:
+    // underflow, but non-virtual so that the internal callers don't pay
+    // for dispatch
+    int refill() {
+      if (this->gptr() == this->egptr()) {
+        counters(fd).underflows.add(1);
+        this->index_buffer();
+        if (this->decoder) {
+          size_t n = this->decoder->decompress(buf, capacity);
+          this->setg(buf, buf, buf + n);
+          this->pos += n;
+        } else if (this->mapped) {
+          this->flush_skip();
+          size_t n = map(fd, window, default_mapsize);
+          this->setg(window.data(), window.data(), window.data() + n);
+          this->pos += n;
+        } else if (this->prefetching) {
+          auto c = this->prefetch().next();
+          this->setg(c.begin, c.begin, c.end);
+          this->pos += c.end - c.begin;
+        } else if (this->odirect) {
+          this->fill_aligned(1);
+        } else if (this->nonblocking) {
+          this->fill_nonblocking();
+        } else if (this->positional) {
+          size_t n = this->read_at_pos(buf, capacity);
+          this->setg(buf, buf, buf + n);
+          this->pos += n;
+        } else {
+          this->maybe_grow();
+          size_t head;
+          size_t n = this->read_pending(head);
+          this->setg(buf, buf + head, buf + n);
+          this->pos += n - head;
+          this->full_reads = n == this->capacity ? this->full_reads + 1 : 0;
+        }
+
+        if (this->dropping && !this->decoder) {
+          this->drop_consumed();
+        }
+      }
+
+      return this->gptr() == this->egptr()
+        ? std::char_traits<char>::eof()
+        : std::char_traits<char>::to_int_type(*this->gptr());
+    }
+
+    void init(fdistream::mode m) {
+      // decoders read the fd themselves
+      if (m & fdistream::decompress) {
+        m &= ~(fdistream::mmap | fdistream::prefetch | fdistream::direct | fdistream::nonblock |
+               fdistream::positional);
+      }
+
+      if ((m & fdistream::positional) && fdtype(fd) == FdType::reg) {
+        this->positional = true;
+      }
+      this->mapped = (m & fdistream::mmap) && fdtype(fd) == FdType::reg && !this->positional;
+      this->nonblocking = (m & fdistream::nonblock) && fdtype(fd) != FdType::reg;
+      this->prefetching = (m & fdistream::prefetch) && !this->mapped && !this->nonblocking &&
+        !this->positional;
+      if (this->nonblocking) {
+        this->was_nonblocking = set_nonblocking(fd);
+      }
+      // io_uring waits for readiness rather than failing with EAGAIN
+      if ((m & fdistream::uring) && !this->nonblocking) {
+        set_engine(fd, Engine::uring);
+      }
+      if (fdtype(fd) == FdType::reg) {
+        this->pos = lseek(fd, 0, SEEK_CUR);
+      }
+      if ((m & fdistream::direct) && fdtype(fd) == FdType::reg && !this->mapped && !this->prefetching) {
+        this->odirect = set_direct(fd, true);
+      }
+      this->capacity = preferred_bufsize(fd);
+      this->buf = acquire_buffer(this->capacity);
+      this->setg(buf, buf, buf);
+
+      if (m & fdistream::decompress) {
+        size_t n = sniff(fd, this->buf, this->capacity);
+        this->decoder = make_decoder(fd, this->buf, n);
+        if (this->decoder) {
+          // positions are in the decompressed stream
+          this->pos = 0;
+        } else {
+          // not compressed: the sniffed bytes are the first ones
+          this->setg(this->buf, this->buf, this->buf + n);
+          this->pos += n;
+        }
+      }
+    }
+
+    // where a regular file ends, as far as this stream is concerned
+    off_t end_offset() {
+      return this->limit < std::numeric_limits<off_t>::max() ? this->limit : size(fd);
+    }
+
+    // `pread(2)`s at `pos`, up to `limit`
+    size_t read_at_pos(char* dst, size_t n) {
+      if (this->pos >= this->limit) {
+        return 0;
+      }
+      return pread(fd, dst, std::min<off_t>(n, this->limit - this->pos), this->pos);
+    }
+
+    // O_DIRECT reads must be aligned in both memory and file offset,
+    // so this reads from the start of the block holding `pos` and puts
+    // the bytes before `pos` behind the get pointer. At least `want`
+    // bytes are made available unless EOF is reached. Input assertion:
+    // the get area is empty
+    void fill_aligned(size_t want) {
+      off_t aligned = this->pos - this->pos % direct_align;
+      size_t head = this->pos - aligned;
+      size_t len = (head + want + direct_align - 1) / direct_align * direct_align;
+
+      if (len > this->capacity) {
+        release_buffer(this->buf, this->capacity);
+        this->capacity = len;
+        this->buf = acquire_buffer(this->capacity);
+      }
+
+      size_t got = 0;
+      while (got < head + want) {
+        size_t n = pread(fd, this->buf + got, this->capacity - got, aligned + got);
+        got += n;
+        // short reads only happen at EOF
+        if (n == 0 || n % direct_align != 0) {
+          break;
+        }
+      }
+      if (aligned + static_cast<off_t>(got) > this->limit) {
+        got = std::max<off_t>(this->limit - aligned, 0);
+      }
+
+      if (got > head) {
+        this->setg(this->buf, this->buf + head, this->buf + got);
+        this->pos = aligned + got;
+      } else {
+        this->setg(this->buf, this->buf, this->buf);
+      }
+    }
+
+    // true if reads go straight to a blocking fd (at its offset or, if
+    // positional, at `pos`), rather than through a mapping, the
+    // prefetcher, O_DIRECT's alignment rules or a decoder
+    bool plain() const {
+      return !this->mapped && !this->prefetching && !this->odirect && !this->nonblocking &&
+        !this->decoder;
+    }
+
+    // created on first use, so that `setbuf` can still set the size of
+    // the prefetcher's buffers
+    Prefetcher& prefetch() {
+      if (!this->prefetcher) {
+        this->prefetcher.reset(new Prefetcher{fd, capacity, prefetch_depth});
+      }
+      return *this->prefetcher;
+    }
+
+    // shows the index whatever is in the get area, before it's
+    // replaced or skipped past
+    void index_buffer() {
+      if (this->index) {
+        size_t n = this->egptr() - this->eback();
+        this->index->feed(this->eback(), n, this->pos - n);
+      }
+    }
+
+    // empties the get area before a skip past its end. Left in place,
+    // its bytes would pass for the ones just before the new position
+    // (see `seekoff`)
+    void clear_get_area() {
+      this->index_buffer();
+      this->setg(this->buf, this->buf, this->buf);
+    }
+
+    // skips bytes that come after the (empty) get area
+    void skip_unbuffered(size_t n) {
+      this->index_buffer();
+      this->pos += n;
+      if (n >= this->capacity && fdtype(fd) == FdType::reg && !this->decoder && !this->odirect) {
+        // with `access::skipping`, the target's pages then arrive while
+        // the caller gets on with whatever comes before the next read
+        // (shorter skips land in what the kernel is reading ahead anyway)
+        will_need(fd, this->pos);
+      }
+      if (this->odirect || this->nonblocking || this->prefetching || this->decoder) {
+        counters(fd).skipped_deferred.add(n);
+      }
+
+      if (this->decoder) {
+        // decompressed into the (consumed) buffer and dropped
+        this->decoder->skip(n, this->buf, this->capacity);
+        this->setg(this->buf, this->buf, this->buf);
+      } else if (this->odirect || this->positional) {
+        // reads are at `pos`
+        return;
+      } else if (this->nonblocking) {
+        // skipping could block, so `fill_nonblocking` drops the bytes
+        // when they arrive
+        this->pending_skip += n;
+      } else if (this->prefetching) {
+        this->prefetch().skip(n);
+      } else {
+        // left for the next read, so that runs of skips cost one
+        // syscall (see `flush_skip`)
+        this->pending_skip += n;
+      }
+    }
+
+    // fills `buf` from the fd's offset, first doing any pending skip.
+    // Skips below `discard_below` are read along with what follows
+    // them instead: `head` is set to the number of bytes at the front
+    // of `buf` that belong to the skip. Returns the number of bytes in
+    // `buf`, which is 0 at EOF
+    size_t read_pending(size_t& head) {
+      head = 0;
+      if (this->pending_skip == 0 ||
+          this->pending_skip >= std::min(discard_below[static_cast<int>(fdtype(fd))], this->capacity / 2)) {
+        this->flush_skip();
+        return read(fd, this->buf, this->capacity);
+      }
+
+      counters(fd).skipped_deferred.add(this->pending_skip);
+      for (;;) {
+        size_t n = read(fd, this->buf, this->capacity);
+        if (n == 0 || n > this->pending_skip) {
+          head = std::min(n, this->pending_skip);
+          this->pending_skip = 0;
+          return n;
+        }
+        this->pending_skip -= n;
+      }
+    }
+
+    // does the skips that `skip_unbuffered` left for the next read of
+    // the fd at its offset, as one `skip`. Not for non-blocking fds,
+    // which drop skipped bytes as they arrive
+    void flush_skip() {
+      if (this->pending_skip > 0) {
+        skip(this->fd, this->pending_skip);
+        this->pending_skip = 0;
+      }
+    }
+
+    // drops pages before the get area from the page cache, in large
+    // enough chunks that the `posix_fadvise(2)`s are cheap
+    void drop_consumed() {
+      off_t begin = this->pos - (this->egptr() - this->eback());
+      if (begin - this->dropped >= drop_chunk) {
+        fadvise(fd, this->dropped, begin - this->dropped, POSIX_FADV_DONTNEED);
+        this->dropped = begin;
+      }
+    }
+
+    // on pipes and sockets, a run of reads that filled the whole buffer
+    // means more is queued than fits, so double the (empty) buffer
+    void maybe_grow() {
+      if (this->full_reads >= grow_after &&
+          this->owned &&
+          this->capacity < max_bufsize &&
+          fdtype(fd) != FdType::reg) {
+        release_buffer(this->buf, this->capacity);
+        this->capacity = std::min(2 * this->capacity, max_bufsize);
+        this->buf = acquire_buffer(this->capacity);
+        this->setg(this->buf, this->buf, this->buf);
+        this->full_reads = 0;
+      }
+    }
+
+    // moves the unread bytes to the front of `buf`, growing it to hold
+    // at least `n` bytes if necessary
+    void compact(size_t n) {
+      this->index_buffer();
+      auto avail = this->egptr() - this->gptr();
+
+      if (n > this->capacity) {
+        size_t newcap = std::max(n, 2 * this->capacity);
+        char* newbuf = acquire_buffer(newcap);
+        std::copy(this->gptr(), this->egptr(), newbuf);
+        if (this->owned) {
+          release_buffer(this->buf, this->capacity);
+        }
+        this->owned = true;
+        this->buf = newbuf;
+        this->capacity = newcap;
+      } else if (avail > 0) {
+        // (an empty get area may be null, e.g. a mapping at EOF)
+        std::memmove(this->buf, this->gptr(), avail);
+      }
+
+      this->setg(this->buf, this->buf, this->buf + avail);
+    }
+
+    Fd fd;
+    Mapping window;
+    bool mapped = false;
+    char* buf = nullptr;
+    size_t capacity = 0;
+    bool owned = true;
+    unsigned full_reads = 0;
+    off_t pos = 0;
+    bool odirect = false;
+    bool positional = false;
+    off_t limit = std::numeric_limits<off_t>::max();
+    bool nonblocking = false;
+    bool was_nonblocking = false;
+    bool blocked = false;
+    size_t pending_skip = 0;
+    bool dropping = false;
+    off_t dropped = 0;
+    bool prefetching = false;
+    std::unique_ptr<Prefetcher> prefetcher;
+    std::unique_ptr<Decoder> decoder;
+    std::unique_ptr<RecordIndex> index;
+  };
+
+  fdistream::fdistream(const std::string& pth, mode m): buf{new (storage) fdbuf(pth, m)} {
+    static_assert(sizeof(fdbuf) <= sizeof(storage) &&
+                  alignof(fdbuf) <= alignof(std::max_align_t),
+                  "fdistream::storage is too small to hold an fdbuf");
+    this->rdbuf(buf);
+  }
+
+  fdistream::fdistream(int fd, mode m): buf{new (storage) fdbuf(fd, m)} {
+    this->rdbuf(buf);
+  }
+
+  fdistream::fdistream(int fd, fdrange r, mode m): buf{new (storage) fdbuf(fd, r.begin, r.end, m)} {
+    this->rdbuf(buf);
+  }
+
+  fdistream::~fdistream() noexcept {
+    buf->~fdbuf();
+  }
+
+  std::string_view fdistream::peek_span(std::size_t n) {
+    if (!this->good() || n > max_peek) {
+      this->setstate(std::ios::failbit);
+      return {};
+    }
+
+    auto view = buf->peek(n);
+    if (view.size() < n) {
+      this->setstate(std::ios::eofbit);
+    }
+
+    return view;
+  }
+
+  std::string_view fdistream::scan_until(char delim) {
+    if (!this->good()) {
+      this->setstate(std::ios::failbit);
+      return {};
+    }
+
+    auto view = buf->scan(delim);
+    if (view.empty()) {
+      this->setstate(std::ios::eofbit | std::ios::failbit);
+    } else if (view.back() != delim) {
+      this->setstate(std::ios::eofbit);
+    }
+
+    return view;
+  }
+
+  bool fdistream::read_line(std::string_view& line) {
+    line = this->scan_until('\n');
+    if (this->fail()) {
+      return false;
+    }
+
+    if (line.back() == '\n') {
+      line.remove_suffix(1);
+    }
+    return true;
+  }
+
+  std::size_t fdistream::forward_to(int out_fd, std::size_t n) {
+    if (!this->good()) {
+      this->setstate(std::ios::failbit);
+      return 0;
+    }
+
+    std::size_t done = buf->forward_to(out_fd, n);
+    if (done < n) {
+      this->setstate(std::ios::eofbit);
+    }
+
+    return done;
+  }
+
+  fdistream& fdistream::advise(access a, bool drop_consumed) {
+    buf->advise(a, drop_consumed);
+    return *this;
+  }
+
+  fdistream& fdistream::consume(std::size_t n) {
+    if (!this->good()) {
+      this->setstate(std::ios::failbit);
+    } else {
+      buf->consume(n);
+    }
+
+    return *this;
+  }
+
+  fdistream& fdistream::ignore(std::streamsize n, int_type delim) {
+    if (!traits_type::eq_int_type(delim, traits_type::eof())) {
+      // the bytes have to be looked at anyway
+      std::istream::ignore(n, delim);
+      return *this;
+    }
+
+    sentry s{*this, true};
+    if (s && n > 0) {
+      this->skip(n);
+    }
+
+    return *this;
+  }
+
+  std::size_t fdistream::skip(std::size_t n) {
+    if (!this->good()) {
+      this->setstate(std::ios::failbit);
+      return 0;
+    }
+
+    std::size_t done = buf->discard(n);
+    if (done < n) {
+      this->setstate(std::ios::eofbit);
+    }
+
+    return done;
+  }
+
+  fdistream& fdistream::build_index(char delim, std::size_t every, std::size_t every_bytes) {
+    buf->build_index(delim, every, every_bytes);
+    return *this;
+  }
+
+  bool fdistream::seek_record(std::uint64_t n) {
+    // like `seekg`, this clears eofbit first
+    this->clear(this->rdstate() & ~std::ios::eofbit);
+    if (this->fail()) {
+      return false;
+    }
+
+    if (!buf->seek_record(n)) {
+      this->setstate(std::ios::failbit);
+      return false;
+    }
+    return true;
+  }
+
+  void fdistream::save_index(const std::string& pth) {
+    buf->save_index(pth);
+  }
+
+  bool fdistream::load_index(const std::string& pth) {
+    return buf->load_index(pth);
+  }
+
+  std::streamsize fdistream::fill_nonblocking() {
+    if (this->bad()) {
+      return 0;
+    }
+
+    std::streamsize n = buf->fill_nonblocking();
+    if (n > 0) {
+      this->clear();
+    } else if (n == 0 && buf->ready() > 0) {
+      // EOF, but what's buffered still has to be drained (the next
+      // read past it sets eofbit)
+      this->clear();
+    } else if (n == 0) {
+      this->setstate(std::ios::eofbit);
+    }
+
+    return n;
+  }
+
+  std::size_t fdistream::ready_bytes() const {
+    return buf->ready();
+  }
+
+  bool fdistream::would_block() const {
+    return buf->is_blocked();
+  }
+
+  int fdistream::fd() const {
+    return buf->native_fd();
+  }
+
+  fdstats fdistream::stats() const {
+    return buf->stats();
+  }
+
+  fdstats fdistream::thread_stats() {
+    return closed_stats;
+  }
+
+  std::vector<fdrange> split_ranges(int fd, std::size_t n, std::string_view delim) {
+    Fd f{fd};
+    if (fdtype(f) != FdType::reg) {
+      std::stringstream msg;
+      msg << "fd " << fd << ": only regular files can be split into ranges";
+      throw std::runtime_error{msg.str()};
+    }
+
+    off_t total = size(f);
+    std::vector<fdrange> ranges;
+    off_t begin = 0;
+    for (size_t i = 1; i <= n && begin < total; ++i) {
+      off_t cut = total / n * i + total % n * i / n;
+      off_t end = i == n
+        ? total
+        : after_delim(f, std::max<off_t>(begin, cut - delim.size()), total, delim);
+      ranges.push_back({static_cast<std::uint64_t>(begin), static_cast<std::uint64_t>(end)});
+      begin = end;
+    }
+
+    return ranges;
+  }
+
+  class fdobuf : public std::streambuf {
+  public:
+    fdobuf(const std::string& pth): fd{pth, O_WRONLY | O_CREAT | O_TRUNC} {
+      this->init();
+    }
+
+    fdobuf(int _fd): fd{_fd} {
+      this->init();
+    }
+
+    fdobuf(const fdobuf& other) = delete;
+    fdobuf(fdobuf&& tmp) = delete;
+
+    ~fdobuf() noexcept {
+      try {
+        this->flush();
+      } catch (const std::runtime_error&) {
+      }
+      release_buffer(this->buf, this->capacity);
+    }
+
+    fdobuf& operator=(const fdobuf& other) = delete;
+    fdobuf& operator=(fdobuf&& tmp) = delete;
+
+    int overflow(int c) override {
+      this->flush();
+
+      if (c != std::char_traits<char>::eof()) {
+        *this->pptr() = std::char_traits<char>::to_char_type(c);
+        this->pbump(1);
+      }
+
+      return std::char_traits<char>::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+      size_t room = this->epptr() - this->pptr();
+
+      if (static_cast<size_t>(n) <= room) {
+        std::copy(s, s + n, this->pptr());
+        this->pbump(n);
+      } else if (static_cast<size_t>(n) < this->capacity) {
+        // top up the buffer before flushing, so that writes stay
+        // buffer-sized
+        std::copy(s, s + room, this->pptr());
+        this->pbump(room);
+        this->flush();
+        std::copy(s + room, s + n, this->pptr());
+        this->pbump(n - room);
+      } else {
+        // large writes bypass the buffer: the buffered bytes and the
+        // caller's go out in one `writev(2)`
+        struct iovec iov[2] = {
+          {this->pbase(), static_cast<size_t>(this->pptr() - this->pbase())},
+          {const_cast<char*>(s), static_cast<size_t>(n)},
+        };
+        this->write_all(iov, 2);
+        this->setp(this->buf, this->buf + this->capacity);
+      }
+
+      return n;
+    }
+
+    int sync() override {
+      this->flush();
+      return 0;
+    }
+
+    std::streampos seekoff(std::streamoff off,
+                           std::ios::seekdir way,
+                           std::ios::openmode which = std::ios::in | std::ios::out) override {
+      // only `tellp()` is supported
+      if (!(which & std::ios::out) || way != std::ios::cur || off != 0) {
+        return std::streampos(std::streamoff(-1));
+      }
+      return this->pos + (this->pptr() - this->pbase());
+    }
+
+  private:
+    void init() {
+      if (fdtype(fd) == FdType::reg) {
+        this->pos = lseek(fd, 0, SEEK_CUR);
+      }
+      this->capacity = std::max(preferred_bufsize(fd), out_bufsize);
+      this->buf = acquire_buffer(this->capacity);
+      this->setp(this->buf, this->buf + this->capacity);
+    }
+
+    void flush() {
+      struct iovec iov = {this->pbase(), static_cast<size_t>(this->pptr() - this->pbase())};
+      this->write_all(&iov, 1);
+      this->setp(this->buf, this->buf + this->capacity);
+    }
+
+    // input assertion: `iov` has no more than 2 entries
+    void write_all(struct iovec* iov, int iovcnt) {
+      while (iovcnt > 0) {
+        if (iov->iov_len == 0) {
+          ++iov;
+          --iovcnt;
+          continue;
+        }
+
+        size_t n = writev(fd, iov, iovcnt);
+        this->pos += n;
+        while (n > 0 && n >= iov->iov_len) {
+          n -= iov->iov_len;
+          ++iov;
+          --iovcnt;
+        }
+        if (n > 0) {
+          iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+          iov->iov_len -= n;
+        }
+      }
+    }
+
+    Fd fd;
+    char* buf = nullptr;
+    size_t capacity = 0;
+    off_t pos = 0;
+  };
+
+  fdostream::fdostream(const std::string& pth): buf{new (storage) fdobuf(pth)} {
+    static_assert(sizeof(fdobuf) <= sizeof(storage) &&
+                  alignof(fdobuf) <= alignof(std::max_align_t),
+                  "fdostream::storage is too small to hold an fdobuf");
+    this->rdbuf(buf);
+  }
+
+  fdostream::fdostream(int fd): buf{new (storage) fdobuf(fd)} {
+    this->rdbuf(buf);
+  }
+
+  fdostream::~fdostream() noexcept {
+    buf->~fdobuf();
+  }
+
+  // Pumps a source pipe into one pipe per consumer with `tee(2)`, on a
+  // background thread. Each round duplicates whatever the source holds
+  // into every consumer pipe and then discards it from the source. A
+  // consumer pipe with too little room for a whole round (`tee` came
+  // up short) gets the rest of it written from userspace, so that all
+  // consumers see the same bytes.
+  class fdpump {
+  public:
+    fdpump(int src_fd, size_t n, fdistream::mode m): src{src_fd} {
+      if (n == 0) {
+        // there would be no stream for the pump to stop on
+        throw std::runtime_error{"fdtee: needs at least one stream"};
+      } else if (this->src.type != FdType::fifo) {
+        std::stringstream msg;
+        msg << "fdtee: fd " << src_fd << " is not a pipe";
+        throw std::runtime_error{msg.str()};
+      }
+
+      for (size_t i = 0; i < n; ++i) {
+        this->outs.emplace_back(new Pipe);
+        resize(*this->outs.back(), skip_pipesize);
+        // so that the pump can always be woken, rather than blocking
+        // on a full pipe
+        ::fcntl(this->outs.back()->write, F_SETFL, O_NONBLOCK);
+        this->streams.emplace_back(new fdistream{this->outs.back()->read, m});
+      }
+
+      this->worker = std::thread{[this]() { this->run(); }};
+    }
+
+    fdpump(const fdpump& other) = delete;
+    fdpump(fdpump&& tmp) = delete;
+
+    ~fdpump() noexcept {
+      if (this->worker.joinable()) {
+        wake(this->waker);
+        this->worker.join();
+      }
+    }
+
+    fdpump& operator=(const fdpump& other) = delete;
+    fdpump& operator=(fdpump&& tmp) = delete;
+
+    size_t size() const noexcept {
+      return this->streams.size();
+    }
+
+    fdistream& stream(size_t i) {
+      return *this->streams.at(i);
+    }
+
+    void join() {
+      if (this->worker.joinable()) {
+        this->worker.join();
+      }
+      if (this->error) {
+        std::rethrow_exception(this->error);
+      }
+    }
+
+  private:
+    void run() {
+      try {
+        this->pump();
+      } catch (...) {
+        this->error = std::current_exception();
+      }
+
+      // consumers see EOF once they have read everything pumped
+      for (auto& p : this->outs) {
+        ::close(p->write);
+        p->write = -1;
+      }
+    }
+
+    void pump() {
+      std::vector<size_t> residual(this->outs.size());
+
+      while (true) {
+        ssize_t k = 0;
+
+        for (size_t i = 0; i < this->outs.size(); ++i) {
+          int out = this->outs[i]->write;
+          ssize_t got;
+
+          while (true) {
+            if ((i == 0 && !wait_for(this->src.fd, POLLIN, this->waker)) ||
+                !wait_for(out, POLLOUT, this->waker)) {
+              return;
+            }
+
+            got = ::tee(this->src.fd, out, i == 0 ? skip_pipesize : k, SPLICE_F_NONBLOCK);
+            if (got != -1) {
+              break;
+            } else if (errno == EAGAIN && i > 0) {
+              // the pipe filled up again: its share is written below
+              got = 0;
+              break;
+            } else if (errno != EAGAIN && errno != EINTR) {
+              std::stringstream msg;
+              msg << "tee failed: " << strerror(errno);
+              throw std::runtime_error{msg.str()};
+            }
+          }
+
+          if (i == 0) {
+            if (got == 0) {
+              return;
+            }
+            k = got;
+          }
+          residual[i] = k - got;
+        }
+
+        if (std::all_of(residual.begin(), residual.end(), [](size_t r) { return r == 0; })) {
+          splice_pipe_to_null(this->src, k);
+          continue;
+        }
+
+        this->scratch.resize(k);
+        for (ssize_t r = 0; r < k; ) {
+          r += read(this->src, this->scratch.data() + r, k - r);
+        }
+        for (size_t i = 0; i < this->outs.size(); ++i) {
+          if (residual[i] > 0 && !this->write(i, this->scratch.data() + (k - residual[i]), residual[i])) {
+            return;
+          }
+        }
+      }
+    }
+
+    // writes to a consumer's pipe. Returns false if woken
+    bool write(size_t i, const char* p, size_t n) {
+      int out = this->outs[i]->write;
+
+      while (n > 0) {
+        if (!wait_for(out, POLLOUT, this->waker)) {
+          return false;
+        }
+
+        ssize_t written = ::write(out, p, n);
+        if (written != -1) {
+          p += written;
+          n -= written;
+        } else if (errno != EAGAIN && errno != EINTR) {
+          std::stringstream msg;
+          msg << "fdtee write failed: " << strerror(errno);
+          throw std::runtime_error{msg.str()};
+        }
+      }
+
+      return true;
+    }
+
+    Fd src;
+    Pipe waker;
+    std::vector<std::unique_ptr<Pipe>> outs;
+    std::vector<std::unique_ptr<fdistream>> streams;
+    std::vector<char> scratch;
+    std::exception_ptr error;
+    std::thread worker;
+  };
+
+  fdtee::fdtee(int src_fd, std::size_t n, fdistream::mode m): pump{new fdpump(src_fd, n, m)} {
+  }
+
+  fdtee::~fdtee() noexcept {
+    delete pump;
+  }
+
+  std::size_t fdtee::size() const noexcept {
+    return pump->size();
+  }
+
+  fdistream& fdtee::operator[](std::size_t i) {
+    return pump->stream(i);
+  }
+
+  void fdtee::join() {
+    pump->join();
+  }
+
+  namespace {
+    // something for the caller to read: buffered bytes, or EOF
+    bool has_input(fdistream& in) {
+      return in.ready_bytes() > 0 || (in.eof() && !in.would_block()) || in.bad();
+    }
+  }
+
+  fdstream_set::fdstream_set(order o): ord{o} {
+    if ((this->epfd = ::epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      std::stringstream msg;
+      msg << "epoll_create1 error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+  }
+
+  fdstream_set::~fdstream_set() noexcept {
+    ::close(this->epfd);
+  }
+
+  void fdstream_set::add(fdistream& in, int priority) {
+    entry e{&in, priority, false, false};
+
+    // the event carries the entry's index, see `remove`
+    struct epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.u64 = this->entries.size();
+    if (::epoll_ctl(this->epfd, EPOLL_CTL_ADD, in.fd(), &ev) != -1) {
+      e.polled = true;
+    } else if (errno != EPERM) {
+      // EPERM: a regular file, which is always ready
+      std::stringstream msg;
+      msg << "epoll_ctl error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+
+    this->entries.push_back(e);
+  }
+
+  void fdstream_set::remove(fdistream& in) {
+    auto it = std::find_if(this->entries.begin(), this->entries.end(),
+                           [&in](const entry& e) { return e.in == &in; });
+    if (it == this->entries.end()) {
+      return;
+    }
+
+    if (it->polled) {
+      ::epoll_ctl(this->epfd, EPOLL_CTL_DEL, in.fd(), nullptr);
+    }
+
+    // the last entry takes its place, so its event's index changes
+    *it = this->entries.back();
+    this->entries.pop_back();
+    if (it != this->entries.end() && it->polled) {
+      struct epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.u64 = it - this->entries.begin();
+      if (::epoll_ctl(this->epfd, EPOLL_CTL_MOD, it->in->fd(), &ev) == -1) {
+        std::stringstream msg;
+        msg << "epoll_ctl error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+    }
+  }
+
+  std::size_t fdstream_set::size() const noexcept {
+    return this->entries.size();
+  }
+
+  const std::vector<fdistream*>& fdstream_set::wait(int timeout_ms) {
+    this->ready.clear();
+    if (this->entries.empty()) {
+      return this->ready;
+    }
+
+    bool any = false;
+    for (entry& e : this->entries) {
+      e.readable = !e.polled;
+      any = any || e.readable || has_input(*e.in);
+    }
+
+    // even if some stream can be returned straight away, the others
+    // should get their turn, so always ask. Room for every stream at
+    // once, as asking again would return the same (level-triggered)
+    // events
+    thread_local std::vector<struct epoll_event> evs;
+    evs.resize(this->entries.size());
+    int n;
+    while ((n = ::epoll_wait(this->epfd, evs.data(), evs.size(), any ? 0 : timeout_ms)) == -1) {
+      if (errno != EINTR) {
+        std::stringstream msg;
+        msg << "epoll_wait error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+    }
+    for (int i = 0; i < n; ++i) {
+      this->entries[evs[i].data.u64].readable = true;
+    }
+
+    // read into the streams that need it: in batches of one io_uring
+    // submission where possible, otherwise one by one
+    Ring* ring = Ring::local();
+    fdistream* batch[ring_entries];
+    unsigned queued = 0;
+
+    auto submit = [&] {
+      int res[ring_entries];
+      ring->submit(res);
+      for (unsigned i = 0; i < queued; ++i) {
+        fdistream& in = *batch[i];
+        std::streamsize got = res[i] == -EINTR ? in.fill_nonblocking() : in.buf->read_done(res[i]);
+        if (got > 0) {
+          in.clear();
+        } else if (got == 0) {
+          in.setstate(std::ios::eofbit);
+        }
+      }
+      queued = 0;
+    };
+
+    for (entry& e : this->entries) {
+      fdistream& in = *e.in;
+      if (!e.readable || has_input(in)) {
+        continue;
+      }
+
+      size_t len;
+      char* dst = ring ? in.buf->read_target(len) : nullptr;
+      if (dst == nullptr) {
+        in.fill_nonblocking();
+        continue;
+      }
+      ring->queue_read(in.fd(), dst, len);
+      batch[queued++] = &in;
+      if (queued == ring_entries) {
+        submit();
+      }
+    }
+    if (queued > 0) {
+      submit();
+    }
+
+    // hand out what has input, starting one further along each time
+    std::size_t count = this->entries.size();
+    std::size_t start = this->next++ % count;
+    this->picked.clear();
+    for (std::size_t k = 0; k < count; ++k) {
+      const entry& e = this->entries[(start + k) % count];
+      if (has_input(*e.in)) {
+        this->picked.push_back(&e);
+      }
+    }
+    if (this->ord == order::priority) {
+      std::stable_sort(this->picked.begin(), this->picked.end(),
+                       [](const entry* a, const entry* b) { return a->priority > b->priority; });
+    }
+    for (const entry* e : this->picked) {
+      this->ready.push_back(e->in);
+    }
+
+    return this->ready;
+  }
+}
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+namespace {
+  // the coroutine `fdloop::run` is resuming, and where an exception
+  // that ends it is kept until then
+  thread_local void* resuming = nullptr;
+  thread_local std::exception_ptr* resumed_error = nullptr;
+
+  // resumes `h`, keeping any exception it ends with in `error` (unless
+  // there already is one)
+  void resume(std::coroutine_handle<> h, std::exception_ptr& error) {
+    void* prev = resuming;
+    std::exception_ptr* prev_error = resumed_error;
+    std::exception_ptr e;
+    resuming = h.address();
+    resumed_error = &e;
+    try {
+      h.resume();
+    } catch (...) {
+      // a coroutine type other than fdtask
+      e = std::current_exception();
+    }
+    resuming = prev;
+    resumed_error = prev_error;
+    if (e && !error) {
+      error = e;
+    }
+  }
+}
+
+namespace ak {
+  void fdtask::promise_type::unhandled_exception() {
+    if (std::coroutine_handle<promise_type>::from_promise(*this).address() == resuming) {
+      // kept for `run`, so that the frame is destroyed (by
+      // `final_suspend`) rather than left suspended with nothing to
+      // destroy it
+      *resumed_error = std::current_exception();
+    } else {
+      // the task hasn't suspended yet, so this goes to its caller, and
+      // the frame is destroyed on the way
+      throw;
+    }
+  }
+
+  fdloop::fdloop() {
+    if ((this->epfd = ::epoll_create1(EPOLL_CLOEXEC)) == -1) {
+      std::stringstream msg;
+      msg << "epoll_create1 error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+  }
+
+  fdloop::~fdloop() noexcept {
+    ::close(this->epfd);
+  }
+
+  // (re)arms a one-shot readiness notification for the op's stream
+  void fdloop::wait(op& o) {
+    struct epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = &o;
+
+    int fd = o.in.fd();
+    if (::epoll_ctl(this->epfd, EPOLL_CTL_MOD, fd, &ev) == -1 &&
+        (errno != ENOENT || ::epoll_ctl(this->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)) {
+      std::stringstream msg;
+      msg << "epoll_ctl error: " << strerror(errno);
+      throw std::runtime_error{msg.str()};
+    }
+    ++this->waiting;
+  }
+
+  void fdloop::run() {
+    struct epoll_event evs[64];
+
+    while (this->waiting > 0) {
+      int n = ::epoll_wait(this->epfd, evs, 64, -1);
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        std::stringstream msg;
+        msg << "epoll_wait error: " << strerror(errno);
+        throw std::runtime_error{msg.str()};
+      }
+
+      // the rest of the round is resumed before anything is
+      // rethrown, so that `waiting` stays in step with what's armed
+      std::exception_ptr error;
+      for (int i = 0; i < n; ++i) {
+        op& o = *static_cast<op*>(evs[i].data.ptr);
+        --this->waiting;
+        try {
+          if (!o.step()) {
+            this->wait(o);
+            continue;
+          }
+        } catch (...) {
+          // thrown from the op's `co_await`
+          o.error = std::current_exception();
+        }
+        resume(o.waiter, error);
+      }
+      if (error) {
+        std::rethrow_exception(error);
+      }
+    }
+  }
+
+  bool fdloop::read_op::step() {
+    fdbuf& b = buf_of(this->in);
+
+    while (this->done < this->dst.size()) {
+      if (b.ready() == 0) {
+        std::streamsize got = b.fill_nonblocking();
+        if (got < 0) {
+          return false;
+        } else if (got == 0) {
+          this->in.setstate(std::ios::eofbit | std::ios::failbit);
+          break;
+        }
+      }
+      size_t len = std::min(b.ready(), this->dst.size() - this->done);
+      this->done += b.sgetn(this->dst.data() + this->done, len);
+    }
+
+    return true;
+  }
+
+  bool fdloop::skip_op::step() {
+    buf_of(this->in).consume(this->n);
+    return true;
+  }
+
+  bool fdloop::read_until_op::step() {
+    fdbuf& b = buf_of(this->in);
+
+    for (;;) {
+      if (b.ready() == 0) {
+        std::streamsize got = b.fill_nonblocking();
+        if (got < 0) {
+          return false;
+        } else if (got == 0) {
+          this->in.setstate(std::ios::eofbit);
+          return true;
+        }
+      }
+
+      std::string_view avail = b.peek(b.ready());
+      size_t i = avail.find(this->delim);
+      if (i != std::string_view::npos) {
+        this->out.append(avail.data(), i);
+        b.consume(i + 1);
+        this->found = true;
+        return true;
+      }
+      this->out.append(avail.data(), avail.size());
+      b.consume(avail.size());
+    }
   }
 }
+#endif
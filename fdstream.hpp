@@ -1,25 +1,822 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
 #include <istream>
+#include <ostream>
+#include <string_view>
+#include <vector>
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#include <exception>
+#include <span>
+#include <string>
+#endif
 
 /**
  * fdistream: custom istream implementation that adds support for
  * high-perf forward-seeking.
+ *
+ * fdostream: the matching ostream, which batches writes.
+ *
+ * fdtee: fans one pipe out to several fdistreams.
+ *
+ * framed_reader: reads length-prefixed records from an fdistream.
+ *
+ * fdstream_set: waits on many fdistreams at once.
+ *
+ * fdloop (C++20): drives many non-blocking fdistreams from coroutines
+ * on one thread.
  */
 namespace ak {
   class fdbuf;
+  class fdobuf;
+  class fdpump;
+  class fdloop;
+  class fdstream_set;
+
+  /**
+   * A byte range `[begin, end)` of a file, see `split_ranges`.
+   */
+  struct fdrange {
+    std::uint64_t begin;
+    std::uint64_t end;
+  };
+
+  /**
+   * Splits the regular file open at `fd` into (up to) `n` ranges of
+   * roughly equal size that cover it, each one ending just after a
+   * `delim` (or at EOF), so that no record straddles two ranges. Each
+   * range can then be read by its own thread through an `fdistream`
+   * on the same fd.
+   */
+  std::vector<fdrange> split_ranges(int fd, std::size_t n, std::string_view delim = "\n");
+
+  /**
+   * I/O counters for an fdistream, see `fdistream::stats`. An
+   * io_uring submission counts as one syscall, and syscalls restarted
+   * after EINTR aren't always counted twice.
+   */
+  struct fdstats {
+    std::uint64_t bytes_read = 0;        // read or mapped from the fd
+    std::uint64_t underflows = 0;        // refills of an empty buffer
+    std::uint64_t reads = 0;             // read(2)/readv(2)/pread(2)s
+    std::uint64_t seeks = 0;             // lseek(2)s
+    std::uint64_t splices = 0;           // splice(2)/sendfile(2)/copy_file_range(2)s
+    std::uint64_t skipped_seek = 0;      // bytes skipped with lseek(2)
+    std::uint64_t skipped_splice = 0;    // bytes skipped by splicing them away
+    std::uint64_t skipped_deferred = 0;  // bytes skipped by a later read (short skips, prefetch, direct, nonblock)
+    std::uint64_t short_reads = 0;       // reads that returned fewer bytes than asked for (but not EOF)
+    std::uint64_t eintr_retries = 0;     // syscalls restarted after EINTR
+    std::uint64_t blocked_ns = 0;        // time spent in reads and skips
+
+    fdstats& operator+=(const fdstats& o);
+  };
 
   class fdistream : public std::istream {
   public:
-    fdistream(const std::string& pth);
-    fdistream(int fd);
+    using mode = unsigned;
+
+    /**
+     * Map regular files into memory (in large windows) and read
+     * straight from the mapping rather than copying through an
+     * internal buffer. Has no effect on other fd types.
+     */
+    static constexpr mode mmap = 1 << 0;
+
+    /**
+     * Read ahead on a background thread, so that the next buffers are
+     * filled while the current one is being parsed. Useful when
+     * parsing is CPU-heavy and the input is slow (e.g. a pipe). Has
+     * no effect when combined with `mmap` on a regular file.
+     */
+    static constexpr mode prefetch = 1 << 1;
+
+    /**
+     * Submit reads and skips through a (per-thread) io_uring rather
+     * than as individual syscalls, which lets multi-step skips (e.g.
+     * over sockets) be issued as a single linked submission. Falls
+     * back to plain syscalls where io_uring is unavailable.
+     */
+    static constexpr mode uring = 1 << 2;
+
+    /**
+     * Read regular files with O_DIRECT, bypassing the page cache, for
+     * one-shot scans of files that shouldn't evict anything else.
+     * Reads are block-aligned (which this stream handles), so small
+     * skips may re-read part of a block. Has no effect in combination
+     * with `mmap` or `prefetch`, or where the filesystem doesn't
+     * support O_DIRECT. The flag is turned back off once the last
+     * stream using it on the fd is destroyed, unless the fd already
+     * had it.
+     */
+    static constexpr mode direct = 1 << 3;
+
+    /**
+     * Put pipes, sockets and ttys into non-blocking mode, so the stream
+     * can be driven from an event loop. A read that finds nothing
+     * ready stops as if at EOF (setting eofbit/failbit), but
+     * `would_block` tells the two apart; once the fd is readable
+     * again, `fill_nonblocking` refills the buffer and clears the
+     * flags. Skips are deferred until the skipped bytes arrive. The
+     * stream's destructor turns O_NONBLOCK back off, unless the fd
+     * already had it. Has no effect on regular files, and takes
+     * precedence over `prefetch` and `uring`.
+     */
+    static constexpr mode nonblock = 1 << 4;
+
+    /**
+     * Transparently decompress gzip, zstd or lz4 (frame format) input,
+     * recognised by its magic number; other input is read as-is. The
+     * library must be built with FDSTREAM_ZLIB, FDSTREAM_ZSTD and/or
+     * FDSTREAM_LZ4 defined (and linked against the library) for each
+     * format, and the first bytes are read when the stream is
+     * constructed. Positions are offsets in the decompressed data.
+     * Forward skips decompress and discard, except in seekable-format
+     * zstd files, where they (and backward seeks) jump to the frame
+     * holding the target. Takes precedence over the other modes,
+     * apart from `uring`.
+     */
+    static constexpr mode decompress = 1 << 5;
+
+    /**
+     * Read regular files with `pread(2)`/`preadv(2)` at an offset kept
+     * by the stream, starting from the fd's offset at construction,
+     * which is then neither used nor moved. Many streams (e.g. one per
+     * thread) can then share one fd without locking. Has no effect on
+     * other fd types, and takes precedence over `mmap` and `prefetch`.
+     */
+    static constexpr mode positional = 1 << 6;
+
+    /**
+     * How a stream is going to be read, see `advise`.
+     */
+    enum class access {
+      normal,      // the kernel's default readahead
+      sequential,  // straight through: readahead more aggressively
+      skipping,    // mostly forward skips: prefetch each target when skipped to
+      random,      // no readahead
+    };
+
+    fdistream(const std::string& pth, mode m = 0);
+    fdistream(int fd, mode m = 0);
+
+    /**
+     * Reads only range `r` of the regular file open at `fd`, with
+     * `pread(2)`: the fd's offset is neither used nor moved, so many
+     * streams (e.g. one per thread) can share the fd. Positions are
+     * file offsets, and EOF is at `r.end`. Of the modes, only `uring`
+     * and `direct` apply (`direct` affects every user of the fd).
+     */
+    fdistream(int fd, fdrange r, mode m = 0);
     fdistream(const fdistream& other) = delete;
     fdistream(fdistream&& tmp) = delete;
     ~fdistream() noexcept;
 
     fdistream& operator=(const fdistream& other) = delete;
     fdistream& operator=(fdistream&& tmp) = delete;
+
+    /**
+     * Returns a view of (up to) the next `n` bytes without extracting
+     * them. The view points into the stream's buffer, which is
+     * compacted or grown so that the bytes are contiguous, and is
+     * invalidated by any other operation on the stream. A view
+     * shorter than `n` means EOF was reached (eofbit is set). An `n`
+     * larger than any buffer could hold sets failbit instead.
+     */
+    std::string_view peek_span(std::size_t n);
+
+    /**
+     * Extracts the bytes up to and including the next `delim` and
+     * returns a view of them, which points into the stream's buffer
+     * and is invalidated by any other operation on the stream. The
+     * search is a `memchr` over the buffer, which is compacted or grown
+     * when a record crosses a refill, so records are never split. If
+     * EOF comes first, the rest of the stream is returned (without a
+     * trailing `delim`) and eofbit is set; failbit too if nothing was
+     * left. In `nonblock` mode, nothing is extracted if the record
+     * isn't all there yet.
+     */
+    std::string_view scan_until(char delim);
+
+    /**
+     * `std::getline` without the copy: `line` is set to a view (see
+     * `scan_until`) of the next line, excluding the newline. Returns
+     * false, with `line` empty, if there was no line left.
+     */
+    bool read_line(std::string_view& line);
+
+    /**
+     * Extracts and discards the next `n` bytes. Typically used to
+     * step over bytes previously returned by `peek_span`.
+     */
+    fdistream& consume(std::size_t n);
+
+    /**
+     * Skips the next `n` bytes without reading them into userspace
+     * where the fd allows it: regular files are seeked over, pipes
+     * spliced into /dev/null and other fds spliced through a pipe.
+     * Unlike `consume` and `seekg`, which leave the skip to the next
+     * read, this finds out where the input ends: returns the number of
+     * bytes skipped, which is less than `n` (and eofbit is set) only
+     * at EOF. In `nonblock` mode, bytes that haven't arrived yet count
+     * as skipped and are dropped when they do, so EOF before then
+     * shows up on the next read instead.
+     */
+    std::size_t skip(std::size_t n);
+
+    /**
+     * `std::istream::ignore`, but without a delimiter the bytes are
+     * skipped as `skip` does rather than read one buffer at a time.
+     * `gcount()` isn't updated in that case (use `skip` for the
+     * count). This hides rather than overrides the base's `ignore`,
+     * so code that only has a `std::istream&` still gets the base's;
+     * for regular files, `mmap` makes that cheap too.
+     */
+    fdistream& ignore(std::streamsize n = 1, int_type delim = traits_type::eof());
+
+    /**
+     * Writes the next `n` bytes of the stream to `out_fd`. Buffered
+     * bytes are written first; the rest are moved in-kernel (with
+     * `splice(2)`, `sendfile(2)` or `copy_file_range(2)`, depending on
+     * the two fd types) without being copied through userspace.
+     * Returns the number of bytes written, which is less than `n`
+     * (and eofbit is set) only at EOF.
+     */
+    std::size_t forward_to(int out_fd, std::size_t n);
+
+    /**
+     * Tells the kernel how a regular file is going to be read (see
+     * `posix_fadvise(2)`), so that the page cache is filled ahead of
+     * the reads. With `drop_consumed`, pages behind the read position
+     * are also dropped from the page cache as the stream advances, so
+     * that one pass over a huge file doesn't evict everything else.
+     * Has no effect on other fd types.
+     */
+    fdistream& advise(access a, bool drop_consumed = false);
+
+    /**
+     * Starts a sparse index of the stream's records, each ending in
+     * `delim`, for `seek_record`: the record at the current position
+     * is record 0, and the offset of every `every`th record after it
+     * (or sooner, once `every_bytes` have gone by) is noted as the
+     * bytes are read. Skipped or forwarded bytes aren't seen, so the
+     * index only grows while reading carries on from its end. Its size
+     * is bounded: past 64Ki entries, every other one is dropped and
+     * the spacing doubled.
+     */
+    fdistream& build_index(char delim = '\n', std::size_t every = 1024,
+                           std::size_t every_bytes = 1 << 20);
+
+    /**
+     * Moves to the start of record `n` (counting from 0, see
+     * `build_index`): seeks to the closest indexed record before it,
+     * then reads through up to `every` records to reach it, or on from
+     * the end of the index (extending it). Returns false, setting
+     * failbit, if there is no index, the stream has fewer records, or
+     * it can't seek back (e.g. a pipe).
+     */
+    bool seek_record(std::uint64_t n);
+
+    /**
+     * Writes the index to a sidecar file at `pth`, stamped with the
+     * input's size and modification time, so that later streams over
+     * the same file can `load_index` it rather than rebuild it. The
+     * file is in native byte order. Throws if there is no index.
+     */
+    void save_index(const std::string& pth);
+
+    /**
+     * Replaces the index with the one saved at `pth`, so long as it was
+     * saved for this file as it is now (same size and modification
+     * time). Returns false, leaving the index as it was, if not or if
+     * there is no such file.
+     */
+    bool load_index(const std::string& pth);
+
+    /**
+     * Reads whatever the fd has ready onto the end of the buffer,
+     * without blocking (in `nonblock` mode). Returns the number of
+     * bytes added, 0 at EOF or -1 if nothing was ready. Adding bytes,
+     * or finding EOF with bytes still buffered, clears an
+     * eofbit/failbit left behind by a read that would have blocked, so
+     * that the buffer can be drained; eofbit is set once it's empty.
+     * In other modes, this blocks until there is something to add.
+     */
+    std::streamsize fill_nonblocking();
+
+    /**
+     * Returns the number of bytes that can be extracted without
+     * touching the fd.
+     */
+    std::size_t ready_bytes() const;
+
+    /**
+     * Returns true if the last read stopped because the (non-blocking)
+     * fd had nothing ready, rather than at EOF.
+     */
+    bool would_block() const;
+
+    /**
+     * Returns the underlying fd, e.g. for registering it with an event
+     * loop.
+     */
+    int fd() const;
+
+    /**
+     * Returns the stream's I/O counters so far. They are always on,
+     * and cheap enough to stay that way: a few uncontended stores and
+     * a clock read per syscall.
+     */
+    fdstats stats() const;
+
+    /**
+     * Returns the totals of the streams that have been destroyed on
+     * the calling thread.
+     */
+    static fdstats thread_stats();
   private:
+    friend class fdloop;
+    friend class fdstream_set;
+
+    // the fdbuf lives inside the stream, rather than on the heap
+    alignas(std::max_align_t) unsigned char storage[512];
     fdbuf* buf;
   };
+
+  class fdostream : public std::ostream {
+  public:
+    /**
+     * Opens (creating or truncating) the file at `pth` for writing.
+     */
+    fdostream(const std::string& pth);
+
+    /**
+     * Writes to `fd`, which is not closed by the stream.
+     */
+    fdostream(int fd);
+    fdostream(const fdostream& other) = delete;
+    fdostream(fdostream&& tmp) = delete;
+
+    /**
+     * Flushes the buffer. Errors are swallowed: call `flush` first
+     * to see them.
+     */
+    ~fdostream() noexcept;
+
+    fdostream& operator=(const fdostream& other) = delete;
+    fdostream& operator=(fdostream&& tmp) = delete;
+  private:
+    // the fdobuf lives inside the stream, rather than on the heap
+    alignas(std::max_align_t) unsigned char storage[256];
+    fdobuf* buf;
+  };
+
+  /**
+   * Fans a pipe out to `n` fdistreams, each of which sees all of the
+   * pipe's data and can read or skip through it independently. The
+   * data is duplicated in-kernel with `tee(2)` by a background thread,
+   * rather than copied through userspace. Consumers advance together:
+   * one that stops reading eventually stalls the others.
+   */
+  class fdtee {
+  public:
+    /**
+     * Throws if `src_fd` is not a pipe, or `n` is 0. `m` is used for
+     * each stream.
+     */
+    fdtee(int src_fd, std::size_t n, fdistream::mode m = 0);
+    fdtee(const fdtee& other) = delete;
+    fdtee(fdtee&& tmp) = delete;
+    ~fdtee() noexcept;
+
+    fdtee& operator=(const fdtee& other) = delete;
+    fdtee& operator=(fdtee&& tmp) = delete;
+
+    std::size_t size() const noexcept;
+    fdistream& operator[](std::size_t i);
+
+    /**
+     * Blocks until the source reaches EOF and has been passed on to
+     * every stream. Rethrows any error the background thread hit.
+     */
+    void join();
+  private:
+    fdpump* pump;
+  };
+
+  /**
+   * Record headers for `framed_reader`: a length prefix stored as a
+   * `T` (an unsigned integer type), little- or big-endian. Any type
+   * with the same members can stand in for one, e.g. a header with a
+   * type tag ahead of the length, for `framed_reader`'s predicates to
+   * look at.
+   */
+  template<typename T, bool big_endian = false>
+  struct fixed_length {
+    static constexpr std::size_t min_size = sizeof(T);
+    static constexpr std::size_t max_size = sizeof(T);
+
+    // the payload's length, once decoded
+    std::uint64_t length = 0;
+
+    // decodes a header from the `n` bytes at `p`. Returns the number
+    // of bytes it took up, or 0 if more are needed
+    std::size_t decode(const char* p, std::size_t n) noexcept {
+      if (n < sizeof(T)) {
+        return 0;
+      }
+      std::uint64_t v = 0;
+      for (std::size_t i = 0; i < sizeof(T); ++i) {
+        std::uint64_t b = static_cast<unsigned char>(p[i]);
+        v |= b << (8 * (big_endian ? sizeof(T) - 1 - i : i));
+      }
+      this->length = v;
+      return sizeof(T);
+    }
+  };
+
+  /**
+   * A LEB128 varint length prefix (as in protobuf's delimited
+   * streams), see `fixed_length`.
+   */
+  struct varint_length {
+    static constexpr std::size_t min_size = 1;
+    static constexpr std::size_t max_size = 10;
+
+    std::uint64_t length = 0;
+
+    std::size_t decode(const char* p, std::size_t n) noexcept {
+      std::uint64_t v = 0;
+      for (std::size_t i = 0; i < n && i < max_size; ++i) {
+        std::uint64_t b = static_cast<unsigned char>(p[i]);
+        v |= (b & 0x7f) << (7 * i);
+        if (!(b & 0x80)) {
+          this->length = v;
+          return i + 1;
+        }
+      }
+      return 0;
+    }
+  };
+
+  /**
+   * Reads records, each a `Header` (see `fixed_length`) followed by
+   * its payload, from an fdistream. Headers are decoded straight from
+   * the stream's buffer, and payloads are handed out as views of it
+   * (as `fdistream::peek_span` does) or skipped and forwarded without
+   * being read into userspace (as `fdistream::skip` and `forward_to`
+   * do). The header layout is a template parameter, so there's no
+   * per-record dispatch, and no sentries are constructed.
+   *
+   * A truncated or malformed record sets failbit on the stream, as
+   * does a length over the reader's `max_length`, which keeps a
+   * corrupt prefix from growing the buffer without bound. In
+   * `nonblock` mode, a call that fails because the rest of a record
+   * hasn't arrived (`would_block`) can be retried once it has.
+   */
+  template<typename Header>
+  class framed_reader {
+  public:
+    static constexpr std::uint64_t default_max_length = std::uint64_t{1} << 26;
+
+    /**
+     * Records longer than `max_length` (64 MiB by default) are treated
+     * as malformed.
+     */
+    explicit framed_reader(fdistream& in, std::uint64_t max_length = default_max_length):
+      in{in}, max_length{max_length} {}
+
+    /**
+     * Reads the next header, leaving its payload to `payload`, `skip`
+     * or `forward_to`. Returns false at EOF: with only eofbit set if
+     * the stream ended between records, or failbit too if it ended
+     * partway through a header.
+     */
+    bool next_header() {
+      std::size_t want = Header::min_size;
+      for (;;) {
+        // decode from what's buffered before asking for more
+        std::size_t n = std::max(want, std::min(this->in.ready_bytes(), Header::max_size));
+        std::string_view h = this->in.peek_span(n);
+        std::size_t used = h.size() >= want ? this->hdr.decode(h.data(), h.size()) : 0;
+        if (used > 0 && this->hdr.length > this->max_length) {
+          this->in.setstate(std::ios::failbit);
+          return false;
+        } else if (used > 0) {
+          this->in.consume(used);
+          return true;
+        } else if (h.empty() && this->in.eof()) {
+          // a clean EOF, between records
+          return false;
+        } else if (h.size() < want || h.size() >= Header::max_size) {
+          // EOF (before a whole header), or a header too long to be one
+          this->in.setstate(std::ios::failbit);
+          return false;
+        }
+        want = h.size() + 1;
+      }
+    }
+
+    /**
+     * The last header read by `next_header`.
+     */
+    const Header& header() const noexcept {
+      return this->hdr;
+    }
+
+    /**
+     * Extracts the current record's payload and returns a view of it,
+     * which is invalidated by any other operation on the stream.
+     */
+    std::string_view payload() {
+      if (this->hdr.length > this->max_length) {
+        this->in.setstate(std::ios::failbit);
+        return {};
+      }
+      std::string_view p = this->in.peek_span(this->hdr.length);
+      if (p.size() < this->hdr.length) {
+        this->in.setstate(std::ios::failbit);
+        return {};
+      }
+      this->in.consume(p.size());
+      return p;
+    }
+
+    /**
+     * Skips the current record's payload. Returns false if the stream
+     * ended first.
+     */
+    bool skip() {
+      if (this->in.skip(this->hdr.length) < this->hdr.length) {
+        this->in.setstate(std::ios::failbit);
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * Writes the current record's payload to `out_fd`. Returns false
+     * if the stream ended first.
+     */
+    bool forward_to(int out_fd) {
+      if (this->in.forward_to(out_fd, this->hdr.length) < this->hdr.length) {
+        this->in.setstate(std::ios::failbit);
+        return false;
+      }
+      return true;
+    }
+
+    /**
+     * Reads the next record and sets `p` to a view of its payload
+     * (see `payload`). Returns false at EOF.
+     */
+    bool next(std::string_view& p) {
+      if (!this->next_header()) {
+        return false;
+      }
+      p = this->payload();
+      return !this->in.fail();
+    }
+
+    /**
+     * `next`, but records whose header `keep` returns false for are
+     * skipped without being read.
+     */
+    template<typename Pred>
+    bool next_if(std::string_view& p, Pred keep) {
+      while (this->next_header()) {
+        if (keep(static_cast<const Header&>(this->hdr))) {
+          p = this->payload();
+          return !this->in.fail();
+        } else if (!this->skip()) {
+          return false;
+        }
+      }
+      return false;
+    }
+
+    /**
+     * Goes through the rest of the records, writing the payloads of
+     * those whose header `pred` returns true for to `out_fd` and
+     * skipping the others. Returns the number of payloads written.
+     */
+    template<typename Pred>
+    std::size_t forward_if(int out_fd, Pred pred) {
+      std::size_t n = 0;
+      while (this->next_header()) {
+        if (pred(static_cast<const Header&>(this->hdr))) {
+          if (!this->forward_to(out_fd)) {
+            break;
+          }
+          ++n;
+        } else if (!this->skip()) {
+          break;
+        }
+      }
+      return n;
+    }
+  private:
+    fdistream& in;
+    std::uint64_t max_length;
+    Header hdr;
+  };
+
+  /**
+   * Waits on many fdistreams (e.g. hundreds of fifos being merged) at
+   * once with epoll, and reads into every stream that has become
+   * readable as a batch: one io_uring submission per batch where
+   * io_uring is available. Streams are best put in `nonblock` mode;
+   * blocking ones still work, but a skip still pending on one may
+   * block. Regular files are always ready. The set doesn't own its
+   * streams, which must not be destroyed while in it.
+   */
+  class fdstream_set {
+  public:
+    /**
+     * The order `wait` returns ready streams in: rotating, so that
+     * each gets its turn at the front, or highest `priority` first
+     * (rotating among equals).
+     */
+    enum class order {
+      round_robin,
+      priority,
+    };
+
+    explicit fdstream_set(order o = order::round_robin);
+    fdstream_set(const fdstream_set& other) = delete;
+    fdstream_set(fdstream_set&& tmp) = delete;
+    ~fdstream_set() noexcept;
+
+    fdstream_set& operator=(const fdstream_set& other) = delete;
+    fdstream_set& operator=(fdstream_set&& tmp) = delete;
+
+    void add(fdistream& in, int priority = 0);
+    void remove(fdistream& in);
+    std::size_t size() const noexcept;
+
+    /**
+     * Returns the streams that have bytes buffered or have reached
+     * EOF, waiting up to `timeout_ms` (-1: forever) for one to if none
+     * has. Streams that epoll reports readable are read into first.
+     * Streams at EOF keep being returned until removed. The returned
+     * list is invalidated by the next call.
+     */
+    const std::vector<fdistream*>& wait(int timeout_ms = -1);
+  private:
+    struct entry {
+      fdistream* in;
+      int priority;
+      bool polled;    // registered with epoll (not a regular file)
+      bool readable;  // reported readable by the last `epoll_wait`
+    };
+
+    int epfd;
+    order ord;
+    std::vector<entry> entries;
+    std::vector<const entry*> picked;
+    std::vector<fdistream*> ready;
+    std::size_t next = 0;
+  };
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+  /**
+   * A coroutine that starts as soon as it is called and is never
+   * awaited: the usual way to start work on an fdloop. An exception
+   * that escapes it propagates to the caller if the task hasn't yet
+   * suspended, and otherwise is rethrown by `fdloop::run` once the
+   * task's frame has been destroyed.
+   */
+  struct fdtask {
+    struct promise_type {
+      fdtask get_return_object() noexcept { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception();
+    };
+  };
+
+  /**
+   * Runs coroutines that read from (`nonblock`) fdistreams on one
+   * thread. Each `async_*` operation completes straight away if it can
+   * be done with what the stream has ready; otherwise the coroutine is
+   * suspended until epoll reports the fd as readable, at which point
+   * the operation is retried. One coroutine at a time may wait on any
+   * given stream. Requires the library to be built as C++20, too.
+   */
+  class fdloop {
+  public:
+    fdloop();
+    fdloop(const fdloop& other) = delete;
+    fdloop(fdloop&& tmp) = delete;
+    ~fdloop() noexcept;
+
+    fdloop& operator=(const fdloop& other) = delete;
+    fdloop& operator=(fdloop&& tmp) = delete;
+
+    // the awaitables: `step` makes what progress it can without
+    // blocking and returns true once the operation is done
+    class op {
+    public:
+      bool await_ready() { return this->step(); }
+      void await_suspend(std::coroutine_handle<> h) {
+        this->waiter = h;
+        this->loop.wait(*this);
+      }
+    protected:
+      op(fdloop& l, fdistream& s): loop{l}, in{s} {}
+      ~op() = default;
+      virtual bool step() = 0;
+
+      // rethrows what went wrong while the op was retried by `run`
+      void rethrow_error() const {
+        if (this->error) {
+          std::rethrow_exception(this->error);
+        }
+      }
+
+      fdloop& loop;
+      fdistream& in;
+    private:
+      friend class fdloop;
+      std::coroutine_handle<> waiter;
+      std::exception_ptr error;
+    };
+
+    class read_op : public op {
+    public:
+      read_op(fdloop& l, fdistream& s, std::span<char> dst): op{l, s}, dst{dst} {}
+      std::size_t await_resume() const { this->rethrow_error(); return this->done; }
+    private:
+      bool step() override;
+      std::span<char> dst;
+      std::size_t done = 0;
+    };
+
+    class skip_op : public op {
+    public:
+      skip_op(fdloop& l, fdistream& s, std::size_t n): op{l, s}, n{n} {}
+      void await_resume() const { this->rethrow_error(); }
+    private:
+      bool step() override;
+      std::size_t n;
+    };
+
+    class read_until_op : public op {
+    public:
+      read_until_op(fdloop& l, fdistream& s, std::string& out, char delim):
+        op{l, s}, out{out}, delim{delim} {}
+      bool await_resume() const { this->rethrow_error(); return this->found; }
+    private:
+      bool step() override;
+      std::string& out;
+      char delim;
+      bool found = false;
+    };
+
+    /**
+     * Reads `dst.size()` bytes, or fewer at EOF (eofbit and failbit
+     * are then set, as with `read`). Resumes with the number read.
+     */
+    read_op async_read(fdistream& in, std::span<char> dst) {
+      return {*this, in, dst};
+    }
+
+    /**
+     * Skips `n` bytes. In `nonblock` mode this never suspends: the
+     * bytes are dropped as they arrive, and EOF shows up on the next
+     * read.
+     */
+    skip_op async_skip(fdistream& in, std::size_t n) {
+      return {*this, in, n};
+    }
+
+    /**
+     * Appends to `out` up to the next `delim`, which is extracted but
+     * not appended (like `std::getline`). Resumes with false if EOF
+     * came first.
+     */
+    read_until_op async_read_until(fdistream& in, std::string& out, char delim) {
+      return {*this, in, out, delim};
+    }
+
+    /**
+     * Resumes suspended coroutines as their streams become readable,
+     * until none are left waiting. An error retrying an operation is
+     * thrown from its `co_await`. If a task fails, `run` rethrows its
+     * exception after resuming the rest of that round, and can then be
+     * called again to carry on with the others.
+     */
+    void run();
+  private:
+    static fdbuf& buf_of(fdistream& in) { return *in.buf; }
+    void wait(op& o);
+
+    int epfd;
+    std::size_t waiting = 0;
+  };
+#endif
 }
@@ -0,0 +1,349 @@
+// Regression tests for fdistream, mostly for seeking in each of the
+// modes a regular file can be read in: a skip past the buffer must not
+// leave the old buffer looking like the bytes just before the new
+// position, and a seek out of range must fail (before the start) or hit
+// EOF (past the end) without making the stream bad. The rest cover
+// `pubsetbuf` on a stream that already has bytes buffered, restoring
+// O_DIRECT, and reading pipes and sockets.
+//
+// Build and run (from the repo root):
+//
+//     g++ -std=c++17 -O2 -I. tests/seek_test.cpp fdstream.cpp -o seek_test -pthread
+//     ./seek_test
+//
+// Prints each failed check and exits non-zero if there were any.
+
+#include "fdstream.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <ios>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+  constexpr size_t file_size = 5'000'000;
+
+  int failures = 0;
+
+  void check(bool ok, const char* what, ak::fdistream::mode m) {
+    if (!ok) {
+      std::printf("FAIL (mode %u): %s\n", m, what);
+      ++failures;
+    }
+  }
+
+  char at(size_t i) {
+    return 'a' + i % 26;
+  }
+
+  std::string mkfile(const std::string& dir) {
+    std::string pth = dir + "/data";
+    std::ofstream out{pth, std::ios::binary};
+    std::string s;
+    for (size_t i = 0; i < file_size; ++i) {
+      s.push_back(at(i));
+    }
+    out.write(s.data(), s.size());
+    return pth;
+  }
+
+  // the next byte, which is expected to be `at(want)`
+  bool next_is(ak::fdistream& in, size_t want) {
+    char c;
+    return static_cast<std::streamoff>(in.tellg()) == static_cast<std::streamoff>(want) &&
+      in.get(c) && c == at(want);
+  }
+
+  void test_mode(const std::string& pth, ak::fdistream::mode m) {
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.seekg(500'000, std::ios::cur);
+      in.seekg(-10, std::ios::cur);
+      check(next_is(in, 499'991), "seekg forward past the buffer, then back", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.ignore(500'000);
+      in.seekg(-10, std::ios::cur);
+      check(next_is(in, 499'991), "ignore past the buffer, then seekg back", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.skip(1'000'000);
+      in.seekg(-10, std::ios::cur);
+      check(next_is(in, 999'991), "skip past the buffer, then seekg back", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      check(in.skip(file_size) == file_size - 1 && in.eof(), "skip to EOF", m);
+      in.clear();
+      in.seekg(-10, std::ios::end);
+      check(next_is(in, file_size - 10), "skip to EOF, then seekg from the end", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      check(in.skip(SIZE_MAX) == file_size - 1 && in.eof(), "skip more than there is", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.seekg(-10, std::ios::end);
+      std::string_view line;
+      check(in.read_line(line) && line.size() == 10 && in.eof(), "read_line to EOF", m);
+      for (int i = 0; i < 2; ++i) {
+        in.clear();
+        check(!in.read_line(line) && line.empty() && in.eof(), "read_line again at EOF", m);
+      }
+      for (int i = 0; i < 2; ++i) {
+        in.clear();
+        check(in.get() == EOF && in.eof(), "get at EOF", m);
+        in.clear();
+        check(in.peek_span(10).empty() && in.eof(), "peek_span at EOF", m);
+      }
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.consume(SIZE_MAX);
+      check(in.get() == EOF && in.eof() && !in.bad(), "consume more than there is", m);
+      in.clear();
+      in.seekg(-10, std::ios::end);
+      check(next_is(in, file_size - 10), "consume more than there is, then seekg from the end", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.seekg(-1, std::ios::beg);
+      check(in.fail() && !in.bad(), "seekg before the start", m);
+      in.clear();
+      check(next_is(in, 1), "seekg before the start leaves the position", m);
+      in.seekg(-2'000'000, std::ios::cur);
+      check(in.fail() && !in.bad(), "seekg before the start, from the current position", m);
+      in.clear();
+      check(next_is(in, 2), "seekg before the start, from the current position, leaves the position", m);
+      in.seekg(-static_cast<std::streamoff>(file_size) - 1, std::ios::end);
+      check(in.fail() && !in.bad(), "seekg before the start, from the end", m);
+      in.clear();
+      check(next_is(in, 3), "seekg before the start, from the end, leaves the position", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      in.get();
+      in.seekg(file_size + 1'000'000, std::ios::beg);
+      check(!in.fail() && in.get() == EOF && in.eof() && !in.bad(), "seekg past the end", m);
+      in.clear();
+      in.seekg(10, std::ios::end);
+      check(!in.fail() && in.get() == EOF && in.eof() && !in.bad(), "seekg past the end, from the end", m);
+      in.clear();
+      in.seekg(-10, std::ios::end);
+      check(next_is(in, file_size - 10), "seekg past the end, then back", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      std::vector<char> big(2'000'000);
+      in.get();
+      in.read(big.data(), big.size());
+      in.seekg(-10, std::ios::cur);
+      check(next_is(in, 1'999'991), "large read, then seekg back", m);
+    }
+    {
+      ak::fdistream in{pth, m};
+      int out = ::open("/dev/null", O_WRONLY);
+      in.get();
+      in.forward_to(out, 500'000);
+      ::close(out);
+      in.seekg(-10, std::ios::cur);
+      check(next_is(in, 499'991), "forward_to, then seekg back", m);
+    }
+  }
+
+  // the bytes `decompress` sniffs from plain input must survive a
+  // `pubsetbuf`, and not be left in the buffer it gives back to the pool
+  void test_setbuf(const std::string& pth, const std::string& other) {
+    const ak::fdistream::mode m = ak::fdistream::decompress;
+    ak::fdistream in{pth, m};
+    std::vector<char> buf(16 << 20);
+    check(in.rdbuf()->pubsetbuf(buf.data(), buf.size()) != nullptr, "pubsetbuf after construction", m);
+    // reuses the pooled buffer
+    ak::fdistream next{other, m};
+    next.get();
+    check(next_is(in, 0) && next_is(in, 1), "pubsetbuf keeps the sniffed bytes", m);
+
+    std::vector<char> tiny(1);
+    check(in.rdbuf()->pubsetbuf(tiny.data(), tiny.size()) == nullptr, "pubsetbuf too small for what's buffered", m);
+    check(next_is(in, 2), "refused pubsetbuf keeps the buffer", m);
+  }
+
+  bool has_direct(int fd) {
+    return ::fcntl(fd, F_GETFL) & O_DIRECT;
+  }
+
+  // `direct` leaves O_DIRECT as it found it, and on while any stream
+  // over the fd still uses it
+  void test_direct_flag(const std::string& pth) {
+    const ak::fdistream::mode m = ak::fdistream::direct;
+    int fd = ::open(pth.c_str(), O_RDONLY | O_DIRECT);
+    if (fd == -1) {
+      // the filesystem doesn't support it
+      return;
+    }
+    {
+      ak::fdistream in{fd, m};
+      in.get();
+    }
+    check(has_direct(fd), "O_DIRECT set by the caller is kept", m);
+    ::close(fd);
+
+    fd = ::open(pth.c_str(), O_RDONLY);
+    {
+      ak::fdistream second{fd, ak::fdrange{file_size / 2, file_size}, m};
+      {
+        ak::fdistream first{fd, ak::fdrange{0, file_size / 2}, m};
+        check(has_direct(fd), "direct turns O_DIRECT on", m);
+      }
+      check(has_direct(fd), "O_DIRECT stays on for the ranges still reading", m);
+    }
+    check(!has_direct(fd), "O_DIRECT is turned off after the last range", m);
+    ::close(fd);
+  }
+
+  // lines still buffered when `fill_nonblocking` finds EOF must not be
+  // lost to the eofbit it sets
+  void test_nonblock_eof() {
+    const ak::fdistream::mode m = ak::fdistream::nonblock;
+    int p[2];
+    if (::pipe(p) == -1) {
+      check(false, "pipe", m);
+      return;
+    }
+    std::string lines;
+    for (int i = 0; i < 10; ++i) {
+      lines += "line " + std::to_string(i) + "\n";
+    }
+    bool wrote = ::write(p[1], lines.data(), lines.size()) == static_cast<ssize_t>(lines.size());
+    ::close(p[1]);
+
+    {
+      ak::fdistream in{p[0], m};
+      std::streamsize n;
+      while ((n = in.fill_nonblocking()) > 0) {
+      }
+      check(wrote && n == 0 && in.ready_bytes() == lines.size(), "fill_nonblocking to EOF", m);
+      std::string got;
+      std::string_view line;
+      while (in.read_line(line)) {
+        got.append(line);
+        got.push_back('\n');
+      }
+      check(got == lines && in.eof(), "read_line after fill_nonblocking finds EOF", m);
+    }
+    ::close(p[0]);
+  }
+
+  // a non-blocking skip of bytes that haven't arrived yet drops them
+  // when they do, rather than stopping as if at EOF
+  void test_nonblock_skip() {
+    const ak::fdistream::mode m = ak::fdistream::nonblock;
+    int p[2];
+    if (::pipe(p) == -1) {
+      check(false, "pipe", m);
+      return;
+    }
+    {
+      ak::fdistream in{p[0], m};
+      const std::string head(100, 'a');
+      const std::string rest = std::string(900, 'b') + "tail\n";
+      bool wrote = ::write(p[1], head.data(), head.size()) == static_cast<ssize_t>(head.size());
+      check(wrote && in.skip(1000) == 1000 && !in.eof() && in.would_block(), "skip more than has arrived", m);
+      wrote = ::write(p[1], rest.data(), rest.size()) == static_cast<ssize_t>(rest.size());
+      std::streamsize n = in.fill_nonblocking();
+      std::string_view line;
+      check(wrote && n > 0 && in.read_line(line) && line == "tail", "skip more than has arrived, then read", m);
+    }
+    ::close(p[0]);
+    ::close(p[1]);
+  }
+
+  // skipping more than there is stops at EOF on pipes and sockets too.
+  // Takes ownership of `fds`, the read and write ends
+  void skip_everything(const int fds[2], const char* what) {
+    const ak::fdistream::mode m = 0;
+    const std::string data(10'000, 'x');
+    bool wrote = ::write(fds[1], data.data(), data.size()) == static_cast<ssize_t>(data.size());
+    ::close(fds[1]);
+    {
+      ak::fdistream in{fds[0], m};
+      in.get();
+      check(wrote && in.skip(SIZE_MAX) == data.size() - 1 && in.eof() && !in.bad(), what, m);
+    }
+    ::close(fds[0]);
+  }
+
+  void test_skip_everything() {
+    int p[2];
+    if (::pipe(p) == -1) {
+      check(false, "pipe", 0);
+    } else {
+      skip_everything(p, "skip more than there is in a pipe");
+    }
+    int sv[2];
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+      check(false, "socketpair", 0);
+    } else {
+      skip_everything(sv, "skip more than there is in a socket");
+    }
+  }
+}
+
+int main() {
+  char dir[] = "/tmp/seek_test.XXXXXX";
+  if (::mkdtemp(dir) == nullptr) {
+    std::perror("mkdtemp");
+    return 1;
+  }
+  std::string pth = mkfile(dir);
+  std::string other = std::string{dir} + "/other";
+  std::ofstream{other, std::ios::binary} << std::string(1 << 20, '?');
+
+  // first, while the buffer `pubsetbuf` gives back is the only one in
+  // the thread's pool
+  test_setbuf(pth, other);
+  test_direct_flag(pth);
+  test_nonblock_eof();
+  test_nonblock_skip();
+  test_skip_everything();
+
+  const ak::fdistream::mode modes[] = {
+    0,
+    ak::fdistream::mmap,
+    ak::fdistream::prefetch,
+    ak::fdistream::uring,
+    ak::fdistream::direct,
+    ak::fdistream::positional,
+  };
+  for (ak::fdistream::mode m : modes) {
+    test_mode(pth, m);
+  }
+
+  ::unlink(pth.c_str());
+  ::unlink(other.c_str());
+  ::rmdir(dir);
+
+  if (failures > 0) {
+    std::printf("%d failed\n", failures);
+    return 1;
+  }
+  std::printf("all passed\n");
+}